@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include "mpc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
 
 #define LASSERT(args, cond, fmt, ...) \
   if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
@@ -16,14 +22,27 @@
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
+// 整数, 大整数或浮点数
+#define LASSERT_NUMBER(func, args, index) \
+  LASSERT(args, args->cell[index]->lisptype == LVAL_NUM \
+    || args->cell[index]->lisptype == LVAL_DBL \
+    || args->cell[index]->lisptype == LVAL_BIG, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->cell[index]->lisptype), ltype_name(LVAL_NUM))
+
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
+#define LASSERT_INDEX(func, args, index, count) \
+  LASSERT(args, args->cell[index]->lnum >= 0 \
+    && args->cell[index]->lnum < count, \
+    "Function '%s' passed index %li out of range [0, %i).", \
+    func, args->cell[index]->lnum, count)
+
 
 #ifdef _WIN32
 
-#include <string.h>
 static char buffer[2048];
 
 char* readline(char* prompt) {
@@ -37,7 +56,15 @@ char* readline(char* prompt) {
 
 void add_history(char* unused) {}
 
+#include <io.h>
+#include <fcntl.h>
+#define STDIN_FILENO 0
+
 #else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #ifdef __linux__
 #include <editline/readline.h>
 #include <editline/history.h>
@@ -53,7 +80,8 @@ void add_history(char* unused) {}
 // enum {LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUMS, LERR_BAD_FUNC};
 // 创建可能的lval类型的枚举
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, 
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_DBL, LVAL_BIG,
+       LVAL_VEC, LVAL_STR
        };
 
 // =========================================
@@ -62,69 +90,300 @@ struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
 
+typedef struct lcode lcode;
+typedef struct lbuf lbuf;
+typedef struct lbig lbig;
+typedef struct lvec lvec;
+typedef struct lreader lreader;
+typedef struct lout lout;
+typedef struct ldump ldump;
+typedef struct lundump lundump;
+
 typedef lval* (*lbuiltin)(lenv*, lval*);
 // Declare New lval Struct
 struct lval
 {
   int lisptype;
-  // Basic
-  union{
-  long lnum;
-  double dnum;
+  // 引用计数, 共享的lval在修改前需要lval_own
+  int ref;
+  // 每种类型只使用自己的那部分, 分配时也只分配这部分(lval_size)
+  union {
+    // Basic
+    long lnum;
+    double dnum;
+    char* err;
+    char* sym;
+    char* str;
+    // 超出long范围的整数, 范围内的一律用lnum
+    lbig* big;
+    lvec* vec;
+    // Function, 函数体保存在code->body
+    struct {
+      lbuiltin builtin;
+      lenv* env;
+      lval* formals;
+      lcode* code;
+    };
+    // Expression, cell指向buf中的一段
+    struct {
+      lval** cell;
+      int count;
+      lbuf* buf;
+    };
   };
-  char* err;
-  char* sym;
-  // Function
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
-  // Expression
-  lval** cell;
+};
+
+// S-/Q-表达式的元素数组, 可由多个切片共享.
+// items[lo, hi)中的元素归lbuf持有
+struct lbuf {
+  int ref;
+  int lo;
+  int hi;
+  int cap;
+  lval* items[];
+};
+
+// 大整数: 符号和绝对值, 绝对值按32位一段从低到高存放, 最高段不为0.
+// 创建后不再修改, 零的count为0
+struct lbig {
+  int sign;
   int count;
+  uint32_t d[];
+};
+
+// 数值向量, 元素直接存放而不是指向lval, 全部是整数或全部是浮点数
+struct lvec {
+  int dbl;
+  int count;
+  union { long l; double d; } items[];
+};
+
+// 读取器: 直接从[p, end)中的字节读出lval, 不要求以'\0'结尾
+struct lreader {
+  // 错误信息中的文件名
+  char* name;
+  char* p;
+  char* end;
+  // start在输入流中的偏移, 输入分块读入时也能算出正确的位置
+  char* start;
+  long off;
+  // 当前行号和行首的偏移, 用于计算错误的位置
+  int line;
+  long bol;
+  char err[512];
+};
+
+// 输出缓冲区: 先把整个lval写到这里, 再一次写出
+struct lout {
+  char* s;
+  size_t len;
+  size_t cap;
+};
+
+// 二进制编码的状态, 记录已经写过的符号和它们的编号
+struct ldump {
+  lout out;
+  // 以符号字符串的地址为键的开放寻址散列表, 符号都已驻留
+  char** keys;
+  int* ids;
+  int cap;
+  int nsyms;
+  // 当前的嵌套深度
+  int depth;
+};
+
+// 二进制解码的状态, syms[i]是编号为i的符号
+struct lundump {
+  // 映射的文件
+  char* map;
+  size_t size;
+  int mapped;
+  char* p;
+  char* end;
+  lval** syms;
+  int nsyms;
+  int cap;
+  int depth;
 };
 
+// 两个乘数都超过这么多段时使用Karatsuba乘法
+#define LBIG_KARATSUBA 32
+
 struct lenv {
   lenv* par;
+  int ref;
   int count;
+  // syms/vals的容量
+  int size;
   char** syms;
   lval** vals;
+  // 绑定较多时使用的开放寻址散列索引, 保存下标+1, 0为空
+  int* index;
+  int nindex;
 };
 
+// 超过这个数量的环境才建立散列索引
+#define LENV_HASH_MIN 16
+
+// 字节码指令
+enum { OP_CONST, OP_LOAD, OP_LOCAL, OP_CALL, OP_TAILCALL,
+       OP_BRANCH, OP_JUMP, OP_RETURN };
+
+// 编译后的lambda函数体, 由函数的副本共享
+struct lcode {
+  int ref;
+  // 不可变的函数体, 所有副本共用
+  lval* body;
+  int* ops;
+  int count;
+  lval** consts;
+  int nconst;
+  // 编译时使用: 栈深度和形式参数
+  int sp;
+  int maxstack;
+  lval* locals;
+};
+
+// 算术和比较运算, 内置函数按运算分派, 不再比较名字
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD, LOP_POW, LOP_MIN, LOP_MAX,
+       LOP_GT, LOP_LT, LOP_GE, LOP_LE, LOP_EQ, LOP_NE, LOP_COUNT };
+
+char* lop_name[LOP_COUNT] = {
+  "+", "-", "*", "/", "%", "^", "min", "max",
+  ">", "<", ">=", "<=", "==", "!=" };
+
+// 对xs[i, n)中连续的数字做归约, 四路展开, 各路的累加互不依赖.
+// 遇到非数字时停下, i指向它. OP(acc, y)把y累加到acc, 溢出时置位ovf
+#define LOP_REDUCE(r, xs, i, n, unit, OP) { \
+  long r1 = unit, r2 = unit, r3 = unit; \
+  for (; i + 4 <= n; i += 4) { \
+    lval *x0 = xs[i], *x1 = xs[i+1], *x2 = xs[i+2], *x3 = xs[i+3]; \
+    if (!((x0->lisptype == LVAL_NUM) & (x1->lisptype == LVAL_NUM) \
+        & (x2->lisptype == LVAL_NUM) & (x3->lisptype == LVAL_NUM))) { break; } \
+    OP(r, x0->lnum); OP(r1, x1->lnum); \
+    OP(r2, x2->lnum); OP(r3, x3->lnum); \
+  } \
+  for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) { OP(r, xs[i]->lnum); } \
+  OP(r, r1); OP(r2, r3); OP(r, r2); }
+
+#define LOP_ADD_OP(acc, y) ovf |= __builtin_add_overflow(acc, y, &acc)
+#define LOP_SUB_OP(acc, y) ovf |= __builtin_sub_overflow(acc, y, &acc)
+#define LOP_MUL_OP(acc, y) ovf |= __builtin_mul_overflow(acc, y, &acc)
+#define LOP_MIN_OP(acc, y) acc = (y) < acc ? (y) : acc
+#define LOP_MAX_OP(acc, y) acc = (y) > acc ? (y) : acc
+
+// 求值引擎
+enum { ENGINE_VM, ENGINE_TREE };
+int lisp_engine = ENGINE_VM;
+
+// 内存统计
+struct {
+  long lval_live, lval_peak, lval_total, lval_bytes;
+  long lenv_live, lenv_peak, lenv_total;
+  long slab_bytes;
+} lisp_stats;
+
+// 每次向系统申请的对象个数
+#define SLAB_OBJECTS 512
+
+// 空闲链表节点, 与空闲对象共用内存
+typedef struct lslot { struct lslot* next; } lslot;
+
+// lval的大小类别
+enum { LSIZE_NUM, LSIZE_EXPR, LSIZE_FUN, LSIZE_COUNT };
+
+// 常驻的小整数, 引用计数永远不会降到0
+#define LVAL_SMALL_MIN -128
+#define LVAL_SMALL_MAX 1023
+#define LVAL_IMMORTAL (1 << 30)
+lval lval_small[LVAL_SMALL_MAX - LVAL_SMALL_MIN + 1];
+
+// 符号表: 每个符号名只有一个常驻的lval, 比较符号只需比较指针
+struct {
+  lval** items;
+  int count;
+  int cap;
+} lsym_table;
+
+// 求值器用到的符号
+char* lsym_and;
+char* lsym_if;
+
 
 // =========================================
 
-// 语法树递归
-// lval eval(mpc_ast_t* t);
-lval* lval_read_num(mpc_ast_t* t);
-lval* lval_read(mpc_ast_t* t);
+// reader
+void lreader_init(lreader* r, char* name, char* s, size_t n);
+long lread_pos(lreader* r);
+void lread_space(lreader* r);
+int lread_symchar(int c);
+lval* lread_error(lreader* r, char* expected);
+lval* lread_num(char* s, int n);
+lval* lread_expr(lreader* r);
+lval* lread_list(lreader* r, lval* x, char close);
+lval* lread_str(lreader* r);
+char* lfile_read(int fd, size_t* n);
+char* lfile_map(char* path, size_t* n, int* mapped);
+void lfile_unmap(char* s, size_t n, int mapped);
+lval* lval_load(lenv* e, char* path);
+int lval_batch(lenv* e, int fd);
+lval* lread_all(lreader* r);
 lval* lval_add(lval* v, lval* x);
 // 语法数求值
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_sexpr_call(lenv* e, lval* v);
+lval* lval_eval_nd(lenv* e, lval* v);
+lval* lval_eval_sexpr_nd(lenv* e, lval* v);
 lval* lval_pop(lval* v, int i);
 lval* lval_push(lval* v, lval* x);
 lval* lval_take(lval* v, int i);
 lval* lval_join(lval* x, lval* y);
+// list storage
+lbuf* lbuf_new(int cap);
+void lbuf_del(lbuf* b);
+lval* lval_expr_new(int type, int n);
+void lval_cells_own(lval* v);
+void lval_cells_reserve(lval* v, int n);
+lbuf* lbuf_resize(lbuf* b, int cap);
+lval* lval_add_n(lval* v, lval** xs, int n);
 
-lval* builtin_op(lenv* e, lval* a, char* op);
+lval* builtin_op(lenv* e, lval* a, int op);
+lval* builtin_op_slow(lenv* e, lval* a, int op);
+lval* builtin_op_dbl(lenv* e, lval* a, int op);
+lval* builtin_op_big(lenv* e, lval* a, int op);
+lval* builtin_op_vec(lenv* e, lval* a, int op);
+long lop_pow(long r, long y, int* ovf);
 lval* builtin(lenv* e, lval* a, char* func);
 // function
 lval* builtin_add(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
 lval* builtin_div(lenv* e, lval* a);
+lval* builtin_mod(lenv* e, lval* a);
+lval* builtin_pow(lenv* e, lval* a);
+lval* builtin_min(lenv* e, lval* a);
+lval* builtin_max(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_len(lenv* e, lval* a);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_foldl(lenv* e, lval* a);
+lval* builtin_reverse(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* lval_apply(lenv* e, lval* f, lval** xs, int n);
 lval* builtin_cons(lenv* e, lval* a);
 lval* builtin_init(lenv* e, lval* a);
 // 分支
-lval* builtin_ord(lenv* e, lval* a, char* op);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
+lval* builtin_ord(lenv* e, lval* a, int op);
+lval* builtin_ord_slow(lenv* e, lval* a, int op);
+lval* builtin_ord_dbl(lenv* e, lval* a, int op);
+lval* builtin_ord_big(lenv* e, lval* a, int op);
+lval* builtin_cmp(lenv* e, lval* a, int op);
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
@@ -142,31 +401,131 @@ lval* builtin_put(lenv* e, lval* a);
 lval* lval_fun(lbuiltin func);
 // create a new number type lval
 lval* lval_num(long x);
+// create a new floating point lval
+lval* lval_dbl(double x);
+double lval_to_dbl(lval* x);
+// create an integer lval from a big integer, consumes b
+lval* lval_big(lbig* b);
 
 // create a new error type lval
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
+lval* lval_str(char* s, int n);
+char* lval_strdup(char* s, int n);
 lval* lval_sexpr(void);
 void  lval_del(lval* v);
 lval* lval_copy(lval* v);
+lval* lval_own(lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_bind(lenv* e, lval* f, lval* a);
 int lval_eq(lval* x, lval* y);
 // create qexpr type
 lval* lval_qexpr(void);
 
 // print lavl
 void lval_print(lval* v);
-void lval_expr_print(lval* v, char open, char close);
 void lval_println(lval* v);
+void lval_write(lout* o, lval* v);
+void lval_write_args(lout* o, lval* a);
+void lout_reserve(lout* o, size_t n);
+void lout_putc(lout* o, char c);
+void lout_puts(lout* o, char* s, size_t n);
+void lout_long(lout* o, long x);
+void lout_dbl(lout* o, double x);
+void lout_str(lout* o, char* s);
+void lout_flush(lout* o, FILE* f);
+
+// memory
+void* slab_alloc(lslot** list, size_t size);
+void slab_free(lslot** list, void* p);
+int lval_size(int type);
+lval* lval_alloc(int type);
+void lval_free(lval* v);
+void lval_small_init(void);
+lenv* lenv_alloc(void);
+void lenv_free(lenv* e);
+lval* builtin_stats(lenv* e, lval* a);
+lval* builtin_load(lenv* e, lval* a);
+lval* builtin_print(lenv* e, lval* a);
+lval* builtin_to_string(lenv* e, lval* a);
+
+// binary dump
+void ldump_varint(ldump* d, unsigned long x);
+void ldump_sym(ldump* d, char* s);
+char* ldump_write(ldump* d, lval* v);
+char* ldump_node(ldump* d, lval* v);
+int lundump_varint(lundump* u, unsigned long* x);
+lval* lundump_read(lundump* u);
+lval* lundump_node(lundump* u, int tag);
+lval* ldump_save(ldump* d, char* path);
+lval* lundump_open(lundump* u, char* path, char* magic);
+void lundump_close(lundump* u);
+lval* lval_dump(lval* v, char* path);
+lval* lval_undump(char* path);
+int limage_skip(lenv* e, int i);
+lval* lval_image_save(lenv* e, char* path);
+lval* lval_image_load(lenv* e, char* path);
+lval* builtin_dump(lenv* e, lval* a);
+lval* builtin_undump(lenv* e, lval* a);
+lval* builtin_save_image(lenv* e, lval* a);
+
+// symbol table
+unsigned long lsym_hash(char* s, int n);
+lval* lsym_intern(char* s);
+lval* lsym_intern_n(char* s, int n);
+void lsym_init(void);
+
+// big integer
+lbig* lbig_new(int count);
+lbig* lbig_trim(lbig* b);
+lbig* lbig_from_long(long x);
+lbig* lbig_copy(lbig* b);
+lbig* lbig_of(lval* x);
+int lbig_to_long(lbig* b, long* x);
+double lbig_to_dbl(lbig* b);
+lbig* lbig_read(char* s);
+char* lbig_str(lbig* b);
+int lbig_cmp_mag(lbig* a, lbig* b);
+int lbig_cmp(lbig* a, lbig* b);
+lbig* lbig_add(lbig* a, lbig* b, int bsign);
+lbig* lbig_mul(lbig* a, lbig* b);
+void lbig_divmod(lbig* a, lbig* b, lbig** q, lbig** r);
+lbig* lbig_pow(lbig* a, long n);
+uint32_t lbig_add_raw(uint32_t* r, int nr, uint32_t* a, int na);
+void lbig_sub_raw(uint32_t* r, int nr, uint32_t* a, int na);
+void lbig_mul_raw(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb);
+
+// numeric vector
+lvec* lvec_new(int count, int dbl);
+lvec* lvec_copy(lvec* v, int dbl);
+lvec* lvec_of(lval* x, int dbl);
+lval* lval_vec(lvec* v);
+lval* lvec_get(lvec* v, int i);
+void lvec_write(lout* o, lvec* v);
+int lvec_eq(lvec* x, lvec* y);
+char* lvec_op(lvec* r, lvec* y, int op);
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_vlist(lenv* e, lval* a);
+lval* builtin_vlen(lenv* e, lval* a);
+lval* builtin_vget(lenv* e, lval* a);
+lval* builtin_vset(lenv* e, lval* a);
+lval* builtin_vslice(lenv* e, lval* a);
 
 // lenv function
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+lenv* lenv_own(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
 lenv* lenv_copy(lenv* e);
+int lenv_find(lenv* e, char* sym);
+void lenv_inherit(lenv* e, lenv* x);
+void lenv_reserve(lenv* e, int size);
+void lenv_index(lenv* e, int nindex);
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+char* lbuiltin_name(lbuiltin func);
+lbuiltin lbuiltin_find(char* name, int n);
 void lenv_add_builtins(lenv* e);
 
 char* ltype_name(int t);
@@ -175,56 +534,93 @@ char* ltype_name(int t);
 lval* lval_lambda(lval* formals, lval* body);
 lval* builtin_lambda(lenv* e, lval* a);
 
+// Bytecode VM
+lcode* lcode_compile(lval* formals, lval* body);
+int lcode_local(lcode* c, char* sym);
+void lcode_del(lcode* c);
+void lcode_compile_expr(lcode* c, lval* x, int tail);
+void lcode_compile_list(lcode* c, lval* v, int tail);
+void vm_reserve(int n);
+lval* vm_exec(lenv* e, lcode* c);
+lval* vm_call(lenv* e, lval** xs, int n);
+
 // ===================MAIN======================
 
 int main(int argc, char** argv) {
 
-/* Create Some Parsers */
-mpc_parser_t* Number   = mpc_new("number");
-mpc_parser_t* Symbol   = mpc_new("symbol");
-mpc_parser_t* Sexpr    = mpc_new("sexpr");
-mpc_parser_t* Qexpr    = mpc_new("qexpr");
-mpc_parser_t* Expr     = mpc_new("expr");
-mpc_parser_t* Lispy    = mpc_new("lispy");
-
-/* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                               \
-      number   : /-?[0-9]+\\.?[0-9]*/ ;             \
-      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-      sexpr    : '(' <expr>* ')' ;                  \
-      qexpr    : '{' <expr>* '}' ;                  \
-      expr     : <number> | <symbol>                \
-               | <sexpr> | <qexpr>  ;               \
-      lispy    : /^/ <expr>* /$/ ;                  \
-    ",
-    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+int nfiles = 0;
+char* image = NULL;
+for (int i = 1; i < argc; i++) {
+  // 使用树遍历求值器(用于对比)
+  if (strcmp(argv[i], "--tree") == 0) { lisp_engine = ENGINE_TREE; }
+  // 从save-image保存的映像启动
+  else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+    image = argv[++i];
+    argv[i-1] = argv[i] = NULL;
+  }
+  else { nfiles++; }
+}
+
+lval_small_init();
+lsym_init();
+lenv* e = lenv_new();
+lenv_add_builtins(e);
+
+if (image) {
+  lval* x = lval_image_load(e, image);
+  if (x->lisptype == LVAL_ERR) {
+    lval_println(x);
+    lval_del(x);
+    lenv_del(e);
+    return 1;
+  }
+  lval_del(x);
+}
+
+// MiLisp file.lsp ...: 依次执行文件后退出, 不进入交互模式
+if (nfiles > 0) {
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!argv[i] || strcmp(argv[i], "--tree") == 0) { continue; }
+    lval* x = lval_load(e, argv[i]);
+    if (x->lisptype == LVAL_ERR) {
+      lval_println(x);
+      status = 1;
+    }
+    lval_del(x);
+  }
+  lenv_del(e);
+  return status;
+}
 
+// 输入不是终端(管道或重定向)时不进入交互模式, 按表达式流式求值
+if (!isatty(STDIN_FILENO)) {
+  int status = lval_batch(e, STDIN_FILENO);
+  lenv_del(e);
+  return status;
+}
 
 puts("MiLisp Version 0.0.2.6");
 puts("Press <Ctrl+c> to Exit\n");
 
-lenv* e = lenv_new();
-lenv_add_builtins(e);
-
 while(1) {
   char* input = readline("Lisp>>> ");
+  // EOF
+  if (!input) { break; }
   add_history(input);
-  mpc_result_t r;
-  if(mpc_parse("<stdin>", input, Lispy, &r)) {
-      // mpc_ast_print(r.output);
-      // mpc_ast_delete(r.output);
-      lval* x = lval_eval(e, lval_read(r.output));
+  lreader r;
+  lreader_init(&r, "<stdin>", input, strlen(input));
+  lval* x = lread_all(&r);
+  if (x) {
+      x = lval_eval(e, x);
       lval_println(x);
       lval_del(x);
     } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      puts(r.err);
     }
   free(input);
   }
 
-mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 lenv_del(e);
 return 0;
 }
@@ -237,6 +633,10 @@ char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_DBL: return "Float";
+    case LVAL_BIG: return "Big Number";
+    case LVAL_VEC: return "Vector";
+    case LVAL_STR: return "String";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
@@ -247,10 +647,17 @@ char* ltype_name(int t) {
 
 // computer
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  v = lval_own(v);
+  lval_cells_own(v);
   // Evaluate Children
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
+  return lval_sexpr_call(e, v);
+}
+
+// Call an S-Expression whose cells are already evaluated
+lval* lval_sexpr_call(lenv* e, lval* v) {
   // Error Checking
   for (int i = 0; i < v->count; i++) {
     if (v->cell[i]->lisptype == LVAL_ERR) {return lval_take(v, i);}
@@ -270,9 +677,7 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   }
 
   // Call builtin with operator
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  return lval_call(e, f, v);
 }
 
 lval* lval_eval(lenv* e, lval* v) {
@@ -287,14 +692,46 @@ lval* lval_eval(lenv* e, lval* v) {
   return v;
 }
 
+// Evaluate v without consuming it, used for shared lambda bodies
+lval* lval_eval_nd(lenv* e, lval* v) {
+  if (v->lisptype == LVAL_SYM) {
+    return lenv_get(e, v);
+  }
+  if (v->lisptype == LVAL_SEXPR) {
+    return lval_eval_sexpr_nd(e, v);
+  }
+  return lval_copy(v);
+}
+
+// Evaluate the cells of v as an S-Expression without consuming v
+lval* lval_eval_sexpr_nd(lenv* e, lval* v) {
+  lval* x = lval_expr_new(LVAL_SEXPR, v->count);
+  for (int i = 0; i < v->count; i++) {
+    x->cell[i] = lval_eval_nd(e, v->cell[i]);
+  }
+  return lval_sexpr_call(e, x);
+}
+
 // pop
 lval* lval_pop(lval* v, int i) {
+  lval_cells_own(v);
   // Find the item at i
   lval* x = v->cell[i];
-  // shift memory after the item at i over the top
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  if (i == 0) {
+    // 弹出第一个元素只需移动起点
+    v->cell++;
+    v->buf->lo++;
+  } else {
+    // shift memory after the item at i over the top
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+    v->buf->hi--;
+  }
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  // 元素少于容量的1/4时缩小一半, 避免在临界点反复扩缩
+  if (v->buf->cap > 16 && v->count < v->buf->cap / 4) {
+    v->buf = lbuf_resize(v->buf, v->buf->cap / 2);
+    v->cell = v->buf->items;
+  }
   return x;
 }
 
@@ -308,85 +745,236 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 // 求值函数
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  for (int i = 0; i < a->count; i++) {
-     LASSERT_TYPE(op, a, i, LVAL_NUM);
+lval* builtin_op(lenv* e, lval* a, int op) {
+  if (a->cell[0]->lisptype != LVAL_NUM) { return builtin_op_slow(e, a, op); }
+  lval** xs = a->cell;
+  int n = a->count;
+  long r = xs[0]->lnum;
+  // 溢出时整个表达式按大整数重新计算
+  int ovf = 0;
+  if (op == LOP_SUB && n == 1) {
+    ovf |= __builtin_sub_overflow(0, r, &r);
+  }
+  // 每种运算一个循环, 类型检查和计算在同一遍完成
+  int i = 1;
+  switch (op) {
+    case LOP_ADD: LOP_REDUCE(r, xs, i, n, 0, LOP_ADD_OP); break;
+    case LOP_SUB:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        ovf |= __builtin_sub_overflow(r, xs[i]->lnum, &r);
+      }
+      break;
+    case LOP_MUL: LOP_REDUCE(r, xs, i, n, 1, LOP_MUL_OP); break;
+    case LOP_MIN: LOP_REDUCE(r, xs, i, n, r, LOP_MIN_OP); break;
+    case LOP_MAX: LOP_REDUCE(r, xs, i, n, r, LOP_MAX_OP); break;
+    case LOP_DIV:
+    case LOP_MOD:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        long y = xs[i]->lnum;
+        if (y == 0) {
+          lval_del(a);
+          return lval_err("Division By Zero!");
+        }
+        // LONG_MIN / -1 会溢出
+        if (y == -1) {
+          if (op == LOP_DIV) { ovf |= __builtin_sub_overflow(0, r, &r); }
+          else { r = 0; }
+        } else {
+          r = op == LOP_DIV ? r / y : r % y;
+        }
+      }
+      break;
+    case LOP_POW:
+      // 负指数的结果是浮点数, 交给builtin_op_slow
+      for (; i < n && xs[i]->lisptype == LVAL_NUM && xs[i]->lnum >= 0; i++) {
+        r = lop_pow(r, xs[i]->lnum, &ovf);
+      }
+      break;
   }
-  lval* x = lval_pop(a, 0);
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->lnum = ~x->lnum + 1;
+  if (i < n || ovf) { return builtin_op_slow(e, a, op); }
+  lval* x = lval_take(a, 0);
+  // 独占的对象直接复用, 否则从小整数或对象池中取
+  if (x->ref == 1) {
+    x->lnum = r;
+    return x;
+  }
+  lval_del(x);
+  return lval_num(r);
+}
+
+// r^y for integers and y >= 0, sets *ovf on overflow
+long lop_pow(long r, long y, int* ovf) {
+  // 平方求幂
+  long b = r;
+  r = 1;
+  while (y) {
+    if (y & 1) { *ovf |= __builtin_mul_overflow(r, b, &r); }
+    y >>= 1;
+    if (y) { *ovf |= __builtin_mul_overflow(b, b, &b); }
   }
-  while (a->count > 0) {
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
+  return r;
+}
 
-    if (strcmp(op, "+") == 0) { x->lnum += y->lnum; }
-    if (strcmp(op, "-") == 0) { x->lnum -= y->lnum; }
-    if (strcmp(op, "*") == 0) { x->lnum *= y->lnum; }
-    if (strcmp(op, "%") == 0) { x->lnum %= y->lnum; }
-    if (strcmp(op, "^") == 0) { x->lnum = pow(x->lnum, y->lnum); }
-    if (strcmp(op, "/") == 0) {
-      if (y->lnum == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero!"); break;
-      }
-      x->lnum /= y->lnum;
+// builtin_op for Floats, Big Numbers, Vectors or overflowing Numbers
+lval* builtin_op_slow(lenv* e, lval* a, int op) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->lisptype == LVAL_VEC) { return builtin_op_vec(e, a, op); }
+  }
+  int dbl = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_NUMBER(lop_name[op], a, i);
+    if (a->cell[i]->lisptype == LVAL_DBL) { dbl = 1; }
+    // 整数的负数次幂不是整数, 与浮点数一样处理
+    if (op == LOP_POW && i > 0 && (a->cell[i]->lisptype == LVAL_NUM
+        ? a->cell[i]->lnum < 0 : a->cell[i]->lisptype == LVAL_BIG
+        && a->cell[i]->big->sign < 0)) {
+      dbl = 1;
     }
-    lval_del(y);
   }
-  lval_del(a); 
-  return x;
+  // 出现浮点数时整个表达式按浮点数计算
+  return dbl ? builtin_op_dbl(e, a, op) : builtin_op_big(e, a, op);
 }
 
-
-// Read number 
-lval* lval_read_num(mpc_ast_t* t){
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE
-          ? lval_num(x)
-          : lval_err("Invalid Number!");
+// builtin_op for arguments that include a Float, integers are promoted
+lval* builtin_op_dbl(lenv* e, lval* a, int op) {
+  lval** xs = a->cell;
+  double r = lval_to_dbl(xs[0]);
+  if (op == LOP_SUB && a->count == 1) {
+    r = -r;
+  }
+  for (int i = 1; i < a->count; i++) {
+    double y = lval_to_dbl(xs[i]);
+    switch (op) {
+      case LOP_ADD: r += y; break;
+      case LOP_SUB: r -= y; break;
+      case LOP_MUL: r *= y; break;
+      case LOP_DIV:
+      case LOP_MOD:
+        if (y == 0) {
+          lval_del(a);
+          return lval_err("Division By Zero!");
+        }
+        r = op == LOP_DIV ? r / y : fmod(r, y);
+        break;
+      case LOP_POW: r = pow(r, y); break;
+      case LOP_MIN: if (y < r) { r = y; } break;
+      case LOP_MAX: if (y > r) { r = y; } break;
+    }
+  }
+  lval_del(a);
+  return lval_dbl(r);
 }
 
-// Read type
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number")) return lval_read_num(t);
-  if (strstr(t->tag, "symbol")) return lval_sym(t->contents);
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) {x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  {x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  {x = lval_qexpr(); }
-  // Fill this list with any valid expression contained within
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }  
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "regex") == 0)  { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+// builtin_op for integer arguments, computed exactly
+lval* builtin_op_big(lenv* e, lval* a, int op) {
+  lval** xs = a->cell;
+  lbig* r = lbig_of(xs[0]);
+  if (op == LOP_SUB && a->count == 1) {
+    r->sign = -r->sign;
   }
-  return x;
+  for (int i = 1; i < a->count; i++) {
+    lbig* y = lbig_of(xs[i]);
+    lbig* t = NULL;
+    lbig* m = NULL;
+    long n;
+    switch (op) {
+      case LOP_ADD: t = lbig_add(r, y, 1); break;
+      case LOP_SUB: t = lbig_add(r, y, -1); break;
+      case LOP_MUL: t = lbig_mul(r, y); break;
+      case LOP_DIV:
+      case LOP_MOD:
+        if (y->count == 0) {
+          free(r); free(y); lval_del(a);
+          return lval_err("Division By Zero!");
+        }
+        lbig_divmod(r, y, &t, &m);
+        if (op == LOP_MOD) { lbig* q = t; t = m; m = q; }
+        free(m);
+        break;
+      case LOP_POW:
+        if (!lbig_to_long(y, &n)) {
+          free(r); free(y); lval_del(a);
+          return lval_err("Exponent Too Large!");
+        }
+        t = lbig_pow(r, n);
+        break;
+      case LOP_MIN: t = lbig_cmp(y, r) < 0 ? y : r; break;
+      case LOP_MAX: t = lbig_cmp(y, r) > 0 ? y : r; break;
+    }
+    if (t != r) { free(r); }
+    if (t != y) { free(y); }
+    r = t;
+  }
+  lval_del(a);
+  return lval_big(r);
 }
 
 // Add sub-lval
 lval* lval_add(lval* v, lval* x){
+  lval_cells_reserve(v, 1);
+  v->buf->items[v->buf->hi++] = x;
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  return v;
+}
+
+// Append n cells to v, taking over their references
+lval* lval_add_n(lval* v, lval** xs, int n){
+  if (n == 0) { return v; }
+  lval_cells_reserve(v, n);
+  memcpy(v->buf->items + v->buf->hi, xs, sizeof(lval*) * n);
+  v->buf->hi += n;
+  v->count += n;
   return v;
 }
 
 // NUmber type
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
+  if (x >= LVAL_SMALL_MIN && x <= LVAL_SMALL_MAX) {
+    return lval_copy(&lval_small[x - LVAL_SMALL_MIN]);
+  }
+  lval* v = lval_alloc(LVAL_NUM);
+  v->ref = 1;
   v->lisptype = LVAL_NUM;
   v->lnum = x;
   return v;
 }
 
+// Float type
+lval* lval_dbl(double x) {
+  lval* v = lval_alloc(LVAL_DBL);
+  v->ref = 1;
+  v->lisptype = LVAL_DBL;
+  v->dnum = x;
+  return v;
+}
+
+// Value of a Number, Big Number or Float as a double
+double lval_to_dbl(lval* x) {
+  switch (x->lisptype) {
+    case LVAL_DBL: return x->dnum;
+    case LVAL_BIG: return lbig_to_dbl(x->big);
+    default: return (double)x->lnum;
+  }
+}
+
+// 能放进long的结果退回普通整数
+lval* lval_big(lbig* b) {
+  long x;
+  if (lbig_to_long(b, &x)) {
+    free(b);
+    return lval_num(x);
+  }
+  lval* v = lval_alloc(LVAL_BIG);
+  v->ref = 1;
+  v->lisptype = LVAL_BIG;
+  v->big = b;
+  return v;
+}
+
 // Construct a pointer to a new Error lval
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_ERR);
+  v->ref = 1;
   v->lisptype = LVAL_ERR;
   // 创建一个va列表并进行初始化
   va_list va;
@@ -402,120 +990,277 @@ lval* lval_err(char* fmt, ...) {
 
 // Construct a pointer to a new Symbol lval 
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->lisptype = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  return lval_copy(lsym_intern(s));
+}
+
+// String from the n bytes at s
+lval* lval_str(char* s, int n) {
+  lval* v = lval_alloc(LVAL_STR);
+  v->ref = 1;
+  v->lisptype = LVAL_STR;
+  v->str = lval_strdup(s, n);
   return v;
 }
 
+char* lval_strdup(char* s, int n) {
+  char* x = malloc(n + 1);
+  memcpy(x, s, n);
+  x[n] = '\0';
+  return x;
+}
+
 // create new function
 lval* lval_fun(lbuiltin func){
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_FUN);
+  v->ref = 1;
   v->lisptype = LVAL_FUN;
   v->builtin = func;
+  v->code = NULL;
   return v;
 }
 
 // A pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_SEXPR);
+  v->ref = 1;
   v->lisptype = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->buf = NULL;
   return v;
 }
 
 lval* lval_qexpr(void){
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_QEXPR);
+  v->ref = 1;
   v->lisptype = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->buf = NULL;
   return v;
 }
 
 
 // A function to free memory
 void lval_del(lval* v) {
+  // 仍有其他引用
+  if (--v->ref > 0) { return; }
   switch (v->lisptype)
   {
   case LVAL_NUM: break;
+  case LVAL_DBL: break;
+  case LVAL_BIG:
+    free(v->big); break;
+  case LVAL_VEC:
+    free(v->vec); break;
   case LVAL_FUN: 
     if (!v->builtin) {
       lenv_del(v->env);
       lval_del(v->formals);
-      lval_del(v->body);
+      lcode_del(v->code);
     }
     break;
   case LVAL_ERR:
     free(v->err); break;
-  case LVAL_SYM:
-    free(v->sym); break;
+  case LVAL_STR:
+    free(v->str); break;
   case LVAL_QEXPR:
   case LVAL_SEXPR:
-    for(int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-    free(v->cell);
+    if (v->buf) { lbuf_del(v->buf); }
     break;
   default:
     break;
   }
-  free(v);
+  lval_free(v);
+}
+
+void lout_reserve(lout* o, size_t n) {
+  if (o->len + n <= o->cap) { return; }
+  o->cap = o->cap * 2 > o->len + n ? o->cap * 2 : o->len + n + 256;
+  o->s = realloc(o->s, o->cap);
+}
+
+void lout_putc(lout* o, char c) {
+  if (o->len == o->cap) { lout_reserve(o, 1); }
+  o->s[o->len++] = c;
+}
+
+void lout_puts(lout* o, char* s, size_t n) {
+  lout_reserve(o, n);
+  memcpy(o->s + o->len, s, n);
+  o->len += n;
+}
+
+// 不经过printf, 整数直接转成十进制
+void lout_long(lout* o, long x) {
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (x < 0) { *--p = '-'; }
+  lout_puts(o, p, buf + sizeof(buf) - p);
+}
+
+// 整数值的浮点数也带上小数点, 与整数区分
+void lout_dbl(lout* o, double x) {
+  char buf[32];
+  // 取能读回同一个值的最短写法, 15位有效数字不够时再试16和17位
+  int n = 0;
+  for (int prec = 15; prec <= 17; prec++) {
+    n = snprintf(buf, sizeof(buf), "%.*g", prec, x);
+    if (x != x || strtod(buf, NULL) == x) { break; }
+  }
+  lout_puts(o, buf, n);
+  if (!strpbrk(buf, ".eni")) { lout_puts(o, ".0", 2); }
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
-  for(int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    if (i != (v->count-1)) {
-      putchar(' ');
+// 字符串按读取器能读回的形式写出
+void lout_str(lout* o, char* s) {
+  lout_putc(o, '"');
+  for (; *s; s++) {
+    switch (*s) {
+      case '"':  lout_puts(o, "\\\"", 2); break;
+      case '\\': lout_puts(o, "\\\\", 2); break;
+      case '\n': lout_puts(o, "\\n", 2); break;
+      case '\t': lout_puts(o, "\\t", 2); break;
+      default:   lout_putc(o, *s); break;
     }
   }
-  putchar(close);
+  lout_putc(o, '"');
 }
 
-void lval_print(lval* v) {
-  switch (v->lisptype) {
-    case LVAL_NUM:   printf("%li", v->lnum); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_FUN:   
-      if (v->builtin) {
-      printf("<builtin>"); 
-      } else {
-        printf("(\\"); lval_print(v->formals);
-        putchar(' '); lval_print(v->body);
-        putchar(')');
+// Write the whole buffer to f with one call and empty it
+void lout_flush(lout* o, FILE* f) {
+  fwrite(o->s, 1, o->len, f);
+  o->len = 0;
+}
+
+// Render v into o. 用显式的栈代替递归, 很深的嵌套也不会栈溢出
+void lval_write(lout* o, lval* v) {
+  // 正在写出的表达式或函数, i是下一个要写的元素
+  struct { lval* v; int i; }* st = NULL;
+  int sp = 0, cap = 0;
+  while (1) {
+    if (v) {
+      switch (v->lisptype) {
+        case LVAL_NUM: lout_long(o, v->lnum); break;
+        case LVAL_DBL: lout_dbl(o, v->dnum); break;
+        case LVAL_BIG: {
+          char* s = lbig_str(v->big);
+          lout_puts(o, s, strlen(s));
+          free(s);
+          break;
+        }
+        case LVAL_VEC: lvec_write(o, v->vec); break;
+        case LVAL_ERR:
+          lout_puts(o, "Error: ", 7);
+          lout_puts(o, v->err, strlen(v->err));
+          break;
+        case LVAL_SYM: lout_puts(o, v->sym, strlen(v->sym)); break;
+        case LVAL_STR: lout_str(o, v->str); break;
+        case LVAL_FUN:
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+          if (v->lisptype == LVAL_FUN && v->builtin) {
+            lout_puts(o, "<builtin>", 9);
+            break;
+          }
+          if (v->lisptype == LVAL_FUN) { lout_puts(o, "(\\", 2); }
+          else { lout_putc(o, v->lisptype == LVAL_SEXPR ? '(' : '{'); }
+          if (sp == cap) {
+            cap = cap ? cap * 2 : 16;
+            st = realloc(st, sizeof(*st) * cap);
+          }
+          st[sp].v = v;
+          st[sp].i = 0;
+          sp++;
+          break;
+        default:
+          break;
       }
-      break;
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-    default:
-      break;  
+    }
+    if (sp == 0) { break; }
+
+    // 栈顶的下一个元素, 写完就出栈
+    lval* t = st[sp-1].v;
+    int i = st[sp-1].i++;
+    v = NULL;
+    if (t->lisptype == LVAL_FUN) {
+      // Lambda: (\ formals body)
+      if (i == 0) { v = t->formals; }
+      else if (i == 1) { lout_putc(o, ' '); v = t->code->body; }
+      else { lout_putc(o, ')'); sp--; }
+    } else if (i < t->count) {
+      if (i) { lout_putc(o, ' '); }
+      v = t->cell[i];
+    } else {
+      lout_putc(o, t->lisptype == LVAL_SEXPR ? ')' : '}');
+      sp--;
+    }
+  }
+  free(st);
+}
+
+// Arguments separated by spaces, strings without quotes (print, to-string)
+void lval_write_args(lout* o, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->lisptype == LVAL_STR) {
+      lout_puts(o, a->cell[i]->str, strlen(a->cell[i]->str));
+    } else {
+      lval_write(o, a->cell[i]);
+    }
+    if (i != a->count-1) { lout_putc(o, ' '); }
   }
-  
+}
+
+void lval_print(lval* v) {
+  lout o = {0};
+  lval_write(&o, v);
+  lout_flush(&o, stdout);
+  free(o.s);
 }
 
 void lval_println(lval* v) {
-  lval_print(v);
-  putchar('\n');
+  lout o = {0};
+  lval_write(&o, v);
+  lout_putc(&o, '\n');
+  lout_flush(&o, stdout);
+  free(o.s);
 }
 
 lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+  return builtin_op(e, a, LOP_ADD);
 }
 
 lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+  return builtin_op(e, a, LOP_SUB);
 }
 
 lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+  return builtin_op(e, a, LOP_MUL);
 }
 
 lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+  return builtin_op(e, a, LOP_DIV);
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+  return builtin_op(e, a, LOP_MOD);
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+  return builtin_op(e, a, LOP_POW);
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+  return builtin_op(e, a, LOP_MIN);
+}
+
+lval* builtin_max(lenv* e, lval* a) {
+  return builtin_op(e, a, LOP_MAX);
 }
 
 lval* builtin_head(lenv* e, lval* a) {
@@ -523,11 +1268,10 @@ lval* builtin_head(lenv* e, lval* a) {
   LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("head", a, 0);
   lval* v = lval_take(a, 0);
-  while (v->count > 1)
-  {
-    lval_del(lval_pop(v, 1));
-  }
-  return v;
+  // 只复制第一个元素
+  lval* x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+  lval_del(v);
+  return x;
 }
 
 lval* builtin_tail(lenv* e, lval* a) {
@@ -535,9 +1279,10 @@ lval* builtin_tail(lenv* e, lval* a) {
   LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("tail", a, 0);
 
-  lval* v = lval_take(a, 0);
-  // del first
-  lval_del(lval_pop(v, 0));
+  // 与原列表共享元素数组, 只是切片的起点后移
+  lval* v = lval_own(lval_take(a, 0));
+  v->cell++;
+  v->count--;
   return v;
 }
 
@@ -550,7 +1295,7 @@ lval* builtin_eval(lenv* e, lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_own(lval_take(a, 0));
   x->lisptype = LVAL_SEXPR;
   return lval_eval(e, x);
 }
@@ -559,7 +1304,7 @@ lval* builtin_join(lenv* e, lval* a) {
   for (int i = 0; i < a->count; i++) {
       LASSERT_TYPE("join", a, i, LVAL_QEXPR);
   }
-  lval* x = lval_pop(a, 0);
+  lval* x = lval_own(lval_pop(a, 0));
   while (a->count)
   {
     x = lval_join(x, lval_pop(a, 0));
@@ -570,16 +1315,143 @@ lval* builtin_join(lenv* e, lval* a) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-  while (y->count)
-  {
-    x = lval_add(x, lval_pop(y, 0));
+  if (y->ref == 1 && (!y->buf || y->buf->ref == 1)) {
+    // y之后不再使用, 直接转移元素的引用
+    lval_cells_own(y);
+    x = lval_add_n(x, y->cell, y->count);
+    if (y->buf) { y->buf->hi = y->buf->lo; }
+  } else {
+    for (int i = 0; i < y->count; i++) { lval_copy(y->cell[i]); }
+    x = lval_add_n(x, y->cell, y->count);
   }
   lval_del(y);
   return x;
 }
 
-// lval* builtin_len(lval* a){
-// }
+// Call f on the n values in xs, consumes xs but not f
+lval* lval_apply(lenv* e, lval* f, lval** xs, int n) {
+  lval* a = lval_expr_new(LVAL_SEXPR, n);
+  memcpy(a->cell, xs, sizeof(lval*) * n);
+  return lval_call(e, lval_copy(f), a);
+}
+
+// 以下列表函数一次遍历完成, 不经过head/tail/join的递归.
+// 列表没有共享时直接在原来的元素数组上修改
+
+// (map f {a b c}) -> {(f a) (f b) (f c)}
+lval* builtin_map(lenv* e, lval* a) {
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+  lval* f = lval_pop(a, 0);
+  lval* v = lval_own(lval_take(a, 0));
+  lval_cells_own(v);
+  for (int i = 0; i < v->count; i++) {
+    lval* x = lval_apply(e, f, &v->cell[i], 1);
+    if (x->lisptype == LVAL_ERR) {
+      // cell[i]已经交给了f
+      v->cell[i] = lval_sexpr();
+      lval_del(v);
+      lval_del(f);
+      return x;
+    }
+    v->cell[i] = x;
+  }
+  lval_del(f);
+  return v;
+}
+
+// (filter f {a b c}) -> the elements for which f returns non-zero
+lval* builtin_filter(lenv* e, lval* a) {
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+  lval* f = lval_pop(a, 0);
+  lval* v = lval_own(lval_take(a, 0));
+  lval_cells_own(v);
+  lval* err = NULL;
+  int n = 0;
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->cell[i];
+    lval* y = NULL;
+    if (!err) {
+      // x留在列表中, 传给f的是它的副本
+      lval* c = lval_copy(x);
+      y = lval_apply(e, f, &c, 1);
+    }
+    if (y && y->lisptype == LVAL_ERR) {
+      err = y;
+    } else if (y && y->lisptype != LVAL_NUM) {
+      err = lval_err("Function 'filter' expected Number from predicate. "
+        "Got %s.", ltype_name(y->lisptype));
+      lval_del(y);
+    } else if (y && y->lnum) {
+      v->cell[n++] = x;
+      lval_del(y);
+      continue;
+    } else if (y) {
+      lval_del(y);
+    }
+    lval_del(x);
+  }
+  // 保留的元素已移到前面
+  if (v->buf) { v->buf->hi = v->buf->lo + n; }
+  v->count = n;
+  lval_del(f);
+  if (err) {
+    lval_del(v);
+    return err;
+  }
+  return v;
+}
+
+// (foldl f z {a b c}) -> (f (f (f z a) b) c)
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+  lval* f = a->cell[0];
+  lval* v = a->cell[2];
+  lval* acc = lval_copy(a->cell[1]);
+  for (int i = 0; i < v->count && acc->lisptype != LVAL_ERR; i++) {
+    lval* xs[2] = { acc, lval_copy(v->cell[i]) };
+    acc = lval_apply(e, f, xs, 2);
+  }
+  lval_del(a);
+  return acc;
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+  LASSERT_NUM("reverse", a, 1);
+  LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+  lval* v = lval_own(lval_take(a, 0));
+  lval_cells_own(v);
+  for (int i = 0, j = v->count - 1; i < j; i++, j--) {
+    lval* t = v->cell[i];
+    v->cell[i] = v->cell[j];
+    v->cell[j] = t;
+  }
+  return v;
+}
+
+// (nth 1 {a b c}) -> b
+lval* builtin_nth(lenv* e, lval* a) {
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+  LASSERT_INDEX("nth", a, 0, a->cell[1]->count);
+  lval* x = lval_copy(a->cell[1]->cell[a->cell[0]->lnum]);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+  lval* x = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
 
 // lval* builtin_cons(lval* a) {
 
@@ -596,14 +1468,24 @@ lval* builtin(lenv* e, lval* a, char* func) {
   if (strcmp("tail", func) == 0) { return builtin_tail(e, a); }
   if (strcmp("join", func) == 0) { return builtin_join(e, a); }
   if (strcmp("eval", func) == 0) { return builtin_eval(e, a); }
-  if (strstr("+-/*", func)) { return builtin_op(e, a, func); }
+  for (int op = LOP_ADD; op <= LOP_MAX; op++) {
+    if (strcmp(lop_name[op], func) == 0) { return builtin_op(e, a, op); }
+  }
   lval_del(a);
   return lval_err("Unknown Function!");
 }
 
-// copy an lval
+// copy an lval, the payload is shared until someone mutates it
 lval* lval_copy(lval* v){
-  lval* x = malloc(sizeof(lval));
+  v->ref++;
+  return v;
+}
+
+// Copy-on-write: return an lval that is safe to mutate, consumes v
+lval* lval_own(lval* v){
+  if (v->ref == 1) { return v; }
+  lval* x = lval_alloc(v->lisptype);
+  x->ref = 1;
   x->lisptype = v->lisptype;
   switch (v->lisptype)
   {
@@ -612,116 +1494,236 @@ lval* lval_copy(lval* v){
       x->builtin = v->builtin;
     }else{
       x->builtin = NULL;
-      x->env = lenv_copy(v->env);
+      x->env = v->env;
+      x->env->ref++;
       x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+      x->code = v->code;
+      x->code->ref++;
     }
     break;
   case LVAL_NUM: x->lnum = v->lnum; break;
+  case LVAL_DBL: x->dnum = v->dnum; break;
+  case LVAL_BIG: x->big = lbig_copy(v->big); break;
+  case LVAL_VEC: x->vec = lvec_copy(v->vec, v->vec->dbl); break;
   case LVAL_ERR: 
     x->err = malloc(strlen(v->err)+1);
     strcpy(x->err, v->err);
     break;
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym)+1);
-    strcpy(x->sym, v->sym);
-    break;
+  case LVAL_SYM: x->sym = v->sym; break;
+  case LVAL_STR: x->str = lval_strdup(v->str, strlen(v->str)); break;
   case LVAL_SEXPR:
   case LVAL_QEXPR:
+    // 共享元素数组, 修改元素前由lval_cells_own复制
     x->count = v->count;
-    x->cell = malloc(sizeof(lval*) * x->count);
-    for (int i = 0; i < v->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
-    }
+    x->cell = v->cell;
+    x->buf = v->buf;
+    if (x->buf) { x->buf->ref++; }
   default:
     break;
   }
+  v->ref--;
   return x;
 }
 
 // Create new lenv structure
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lenv_alloc();
+  e->ref = 1;
   e->count = 0;
+  e->size = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->index = NULL;
+  e->nindex = 0;
   e->par = NULL;
   return e;
 }
 
 // Create delete lenv function
 void lenv_del(lenv* e) {
+  if (--e->ref > 0) { return; }
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
   free(e->syms);
   free(e->vals);
-  free(e);
+  free(e->index);
+  lenv_free(e);
 }
 
 // copy lenv
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lenv_alloc();
+  n->ref = 1;
   n->par = e->par;
   n->count = e->count;
+  n->size = e->count;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
+    // 符号名已驻留, 直接复制指针
+    n->syms[i] = e->syms[i];
     n->vals[i] = lval_copy(e->vals[i]);
   }
+  n->index = NULL;
+  n->nindex = 0;
+  if (e->index) {
+    n->nindex = e->nindex;
+    n->index = malloc(sizeof(int) * n->nindex);
+    memcpy(n->index, e->index, sizeof(int) * n->nindex);
+  }
   return n;
 }
 
+// Copy-on-write for environments shared between function copies
+lenv* lenv_own(lenv* e) {
+  if (e->ref == 1) { return e; }
+  e->ref--;
+  return lenv_copy(e);
+}
 
+// 符号已驻留, 直接散列指针
+#define LENV_HASH(sym) \
+  ((((unsigned long)(sym)) * 11400714819323198485UL) >> 32)
 
-// Get vaule in the lenv 
-lval* lenv_get(lenv* e, lval* k) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+// Find the slot of sym in e, -1 if it is not bound here
+int lenv_find(lenv* e, char* sym) {
+  if (e->index) {
+    int mask = e->nindex - 1;
+    int i = LENV_HASH(sym) & mask;
+    while (e->index[i]) {
+      if (e->syms[e->index[i]-1] == sym) { return e->index[i]-1; }
+      i = (i + 1) & mask;
     }
+    return -1;
   }
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
+  for (int i = 0; i < e->count; i++) {
+    if (e->syms[i] == sym) { return i; }
   }
+  return -1;
 }
-// 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  // 遍历环境中的所有项目
-  // 这是为了查看变量是否已经存在。
-  for (int i = 0; i < e->count; i++) {
-    // 如果找到变量，则删除该位置上的项目。
-    // 并用用户提供的变量替换
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
+
+// Copy the bindings of x that e does not shadow into e,
+// 之后在e中求值不会再访问到x. 新的绑定追加在后面, 不影响参数的位置
+void lenv_inherit(lenv* e, lenv* x) {
+  int count = e->count;
+  for (int i = 0; i < x->count; i++) {
+    if (lenv_find(e, x->syms[i]) >= 0) { continue; }
+    if (e->count == e->size) {
+      lenv_reserve(e, e->size ? e->size * 2 : 4);
     }
+    e->syms[e->count] = x->syms[i];
+    e->vals[e->count] = lval_copy(x->vals[i]);
+    e->count++;
+  }
+  if (e->count > count && (e->index || e->count > LENV_HASH_MIN)) {
+    int nindex = 64;
+    while (nindex < e->count * 4) { nindex *= 2; }
+    lenv_index(e, nindex);
   }
-  // 如果没有找到现有的条目，则为新条目分配空间。
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-  // 将lval和符号字符串的内容复制到新位置
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par){
-    e = e->par;
+// Make room for size bindings
+void lenv_reserve(lenv* e, int size) {
+  if (size <= e->size) { return; }
+  e->size = size;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->size);
+  e->syms = realloc(e->syms, sizeof(char*) * e->size);
+}
+
+// (Re)build the hash index of e with nindex buckets
+void lenv_index(lenv* e, int nindex) {
+  free(e->index);
+  e->nindex = nindex;
+  e->index = calloc(nindex, sizeof(int));
+  for (int j = 0; j < e->count; j++) {
+    int i = LENV_HASH(e->syms[j]) & (nindex - 1);
+    while (e->index[i]) { i = (i + 1) & (nindex - 1); }
+    e->index[i] = j + 1;
   }
-  lenv_put(e, k, v);
 }
 
-// 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+// Get vaule in the lenv 
+lval* lenv_get(lenv* e, lval* k) {
+  while (e) {
+    int i = lenv_find(e, k->sym);
+    if (i >= 0) {
+      return lval_copy(e->vals[i]);
+    }
+    e = e->par;
+  }
+  return lval_err("Unbound Symbol '%s'", k->sym);
+}
+// 
+void lenv_put(lenv* e, lval* k, lval* v) {
+  // 查看变量是否已经存在。
+  // 如果找到变量，则删除该位置上的项目。
+  // 并用用户提供的变量替换
+  int i = lenv_find(e, k->sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_copy(v);
+    return;
+  }
+  // 如果没有找到现有的条目，则为新条目分配空间, 容量成倍增长
+  if (e->count == e->size) {
+    lenv_reserve(e, e->size ? e->size * 2 : 4);
+  }
+  e->count++;
+  // 将lval和符号字符串的内容复制到新位置
+  e->vals[e->count-1] = lval_copy(v);
+  e->syms[e->count-1] = k->sym;
+  // 更新散列索引, 保持装载率低于1/2
+  if (e->index && e->count * 2 <= e->nindex) {
+    int j = LENV_HASH(k->sym) & (e->nindex - 1);
+    while (e->index[j]) { j = (j + 1) & (e->nindex - 1); }
+    e->index[j] = e->count;
+  } else if (e->index || e->count > LENV_HASH_MIN) {
+    int nindex = 64;
+    while (nindex < e->count * 4) { nindex *= 2; }
+    lenv_index(e, nindex);
+  }
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+  while (e->par){
+    e = e->par;
+  }
+  lenv_put(e, k, v);
+}
+
+// 
+// 注册过的内置函数的名字, 二进制编码时内置函数按名字保存
+#define LBUILTIN_MAX 128
+struct {
+  char* name;
+  lbuiltin func;
+} lbuiltin_table[LBUILTIN_MAX];
+int lbuiltin_count;
+
+char* lbuiltin_name(lbuiltin func) {
+  for (int i = 0; i < lbuiltin_count; i++) {
+    if (lbuiltin_table[i].func == func) { return lbuiltin_table[i].name; }
+  }
+  return NULL;
+}
+
+lbuiltin lbuiltin_find(char* name, int n) {
+  for (int i = 0; i < lbuiltin_count; i++) {
+    char* s = lbuiltin_table[i].name;
+    if (strncmp(s, name, n) == 0 && s[n] == '\0') {
+      return lbuiltin_table[i].func;
+    }
+  }
+  return NULL;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  if (!lbuiltin_find(name, strlen(name)) && lbuiltin_count < LBUILTIN_MAX) {
+    lbuiltin_table[lbuiltin_count].name = name;
+    lbuiltin_table[lbuiltin_count].func = func;
+    lbuiltin_count++;
+  }
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
   lenv_put(e, k, v);
@@ -736,12 +1738,22 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "reverse", builtin_reverse);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
 
   // Mathematical Functions 
   lenv_add_builtin(e, "+", builtin_add);
   lenv_add_builtin(e, "-", builtin_sub);
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
+  lenv_add_builtin(e, "%", builtin_mod);
+  lenv_add_builtin(e, "^", builtin_pow);
+  lenv_add_builtin(e, "min", builtin_min);
+  lenv_add_builtin(e, "max", builtin_max);
 
   // Variable Functions 
   lenv_add_builtin(e, "def", builtin_def);
@@ -756,6 +1768,22 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "<",  builtin_lt);
   lenv_add_builtin(e, ">=", builtin_ge);
   lenv_add_builtin(e, "<=", builtin_le);
+  // Vector Functions
+  lenv_add_builtin(e, "vec",    builtin_vec);
+  lenv_add_builtin(e, "vlist",  builtin_vlist);
+  lenv_add_builtin(e, "vlen",   builtin_vlen);
+  lenv_add_builtin(e, "vget",   builtin_vget);
+  lenv_add_builtin(e, "vset",   builtin_vset);
+  lenv_add_builtin(e, "vslice", builtin_vslice);
+  // File Functions
+  lenv_add_builtin(e, "load",  builtin_load);
+  lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "to-string", builtin_to_string);
+  lenv_add_builtin(e, "dump", builtin_dump);
+  lenv_add_builtin(e, "undump", builtin_undump);
+  lenv_add_builtin(e, "save-image", builtin_save_image);
+  // Memory Function
+  lenv_add_builtin(e, "stats", builtin_stats);
 }
 
 
@@ -797,12 +1825,14 @@ lval* builtin_put(lenv* e, lval* a) {
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc(LVAL_FUN);
+  v->ref = 1;
   v->lisptype = LVAL_FUN;
   v->builtin = NULL;
   v->env = lenv_new();
   v->formals = formals;
-  v->body = body;
+  // 定义时编译函数体, 函数体归lcode所有
+  v->code = lcode_compile(formals, body);
   return v;
 }
 
@@ -825,9 +1855,41 @@ lval* builtin_lambda(lenv* e, lval* a) {
   return lval_lambda(formals, body);
 }
 
+// Call f with arguments a, consumes both
 lval* lval_call(lenv* e, lval* f, lval* a) {
   // 如果是内置函数，则直接应用它
-  if (f->builtin) return f->builtin(e, a);
+  if (f->builtin) {
+    lbuiltin func = f->builtin;
+    lval_del(f);
+    return func(e, a);
+  }
+  f = lval_bind(e, f, a);
+  // 出错, 或者还有未绑定的参数(部分应用)
+  if (f->lisptype == LVAL_ERR || f->formals->count > 0) {
+    return f;
+  }
+  // 如果所有形式参数都已绑定，请进行计算
+  // 将环境父级设置为计算环境
+  f->env->par = e;
+  lval* result;
+  if (lisp_engine == ENGINE_VM) {
+    result = vm_exec(f->env, f->code);
+  } else {
+    result = lval_eval_sexpr_nd(f->env, f->code->body);
+  }
+  lval_del(f);
+  return result;
+}
+
+// Bind arguments a into a private copy of lambda f, consumes both.
+// Returns the bound function or an error
+lval* lval_bind(lenv* e, lval* f, lval* a) {
+  // 函数可能是共享的, 绑定参数前先复制
+  f = lval_own(f);
+  f->formals = lval_own(f->formals);
+  f->env = lenv_own(f->env);
+  // 按形式参数个数一次分配好栈帧
+  lenv_reserve(f->env, f->env->count + f->formals->count);
   // 记录参数计数
   int given = a->count;
   int total = f->formals->count;
@@ -836,6 +1898,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     // 如果我们已经没有形式参数可绑定
     if (f->formals->count == 0) {
       lval_del(a);
+      lval_del(f);
       return lval_err(        
         "Function passed too many arguments. "
         "Got %i, Expected %i.", given, total);
@@ -843,9 +1906,10 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     // 弹出形式参数的第一个符号
     lval* sym = lval_pop(f->formals, 0);
     // 特殊情况处理'&'
-    if (strcmp(sym->sym, "&") == 0) {
+    if (sym->sym == lsym_and) {
       if (f->formals->count != 1) {
         lval_del(a);
+        lval_del(f);
         return lval_err("Function format invalid. "
           "Symbol '&' not followed by single symbol.");
       }
@@ -867,10 +1931,11 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   // 参数列表现在已经绑定，因此可以清理了
   lval_del(a);
   // 如果'&'保留在形式列表中，则绑定到空列表。
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+  if (f->formals->count > 0 && f->formals->cell[0]->sym == lsym_and) {
     if (f->formals->count != 2) {
-        return lval_err("Function format invalid. "
-      "Symbol '&' not followed by single symbol.");
+      lval_del(f);
+      return lval_err("Function format invalid. "
+        "Symbol '&' not followed by single symbol.");
     }
     lval_del(lval_pop(f->formals, 0));
     lval* sym = lval_pop(f->formals, 0);
@@ -880,70 +1945,141 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     lval_del(sym);
     lval_del(val);
   }
-  // 如果所有形式参数都已绑定，请进行计算
-  if (f->formals->count == 0) {
-    // 将环境父级设置为计算环境
-    f->env->par = e;
-    return builtin_eval(
-      f->env, lval_add(lval_sexpr(),lval_copy(f->body)));
-  } else {
-    return lval_copy(f);
-  }
+  return f;
 }
 
+
 // 排序函数
-lval* builtin_ord(lenv* e, lval* a, char* op){
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+// 多个参数时按链式比较, (< a b c)即a < b且b < c
+lval* builtin_ord(lenv* e, lval* a, int op){
+  LASSERT(a, a->count >= 2,
+    "Function '%s' passed incorrect number of arguments. "
+    "Got %i, Expected at least %i.", lop_name[op], a->count, 2);
+  if (a->cell[0]->lisptype != LVAL_NUM) { return builtin_ord_slow(e, a, op); }
 
-  int r;
-  if (strcmp(op, ">") == 0)  {
-    r = (a->cell[0]->lnum > a->cell[1]->lnum);
+  lval** xs = a->cell;
+  int n = a->count;
+  // 不提前退出, 循环里只有比较和按位与
+  int r = 1;
+  int i = 1;
+  switch (op) {
+    case LOP_GT:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        r &= xs[i-1]->lnum > xs[i]->lnum;
+      }
+      break;
+    case LOP_LT:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        r &= xs[i-1]->lnum < xs[i]->lnum;
+      }
+      break;
+    case LOP_GE:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        r &= xs[i-1]->lnum >= xs[i]->lnum;
+      }
+      break;
+    case LOP_LE:
+      for (; i < n && xs[i]->lisptype == LVAL_NUM; i++) {
+        r &= xs[i-1]->lnum <= xs[i]->lnum;
+      }
+      break;
   }
-  if (strcmp(op, "<") == 0)  {
-    r = (a->cell[0]->lnum < a->cell[1]->lnum);
+  if (i < n) { return builtin_ord_slow(e, a, op); }
+  lval_del(a);
+  return lval_num(r);
+}
+
+// builtin_ord for arguments that include a Float or a Big Number
+lval* builtin_ord_slow(lenv* e, lval* a, int op) {
+  int dbl = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_NUMBER(lop_name[op], a, i);
+    if (a->cell[i]->lisptype == LVAL_DBL) { dbl = 1; }
   }
-  if (strcmp(op, ">=") == 0)  {
-    r = (a->cell[0]->lnum >= a->cell[1]->lnum);
+  return dbl ? builtin_ord_dbl(e, a, op) : builtin_ord_big(e, a, op);
+}
+
+lval* builtin_ord_dbl(lenv* e, lval* a, int op) {
+  int r = 1;
+  double x = lval_to_dbl(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    double y = lval_to_dbl(a->cell[i]);
+    switch (op) {
+      case LOP_GT: r &= x > y; break;
+      case LOP_LT: r &= x < y; break;
+      case LOP_GE: r &= x >= y; break;
+      case LOP_LE: r &= x <= y; break;
+    }
+    x = y;
   }
-  if (strcmp(op, "<=") == 0)  {
-    r = (a->cell[0]->lnum <= a->cell[1]->lnum);
+  lval_del(a);
+  return lval_num(r);
+}
+
+lval* builtin_ord_big(lenv* e, lval* a, int op) {
+  int r = 1;
+  lbig* x = lbig_of(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    lbig* y = lbig_of(a->cell[i]);
+    int c = lbig_cmp(x, y);
+    switch (op) {
+      case LOP_GT: r &= c > 0; break;
+      case LOP_LT: r &= c < 0; break;
+      case LOP_GE: r &= c >= 0; break;
+      case LOP_LE: r &= c <= 0; break;
+    }
+    free(x);
+    x = y;
   }
+  free(x);
   lval_del(a);
   return lval_num(r);
 }
 
 lval* builtin_gt(lenv* e, lval* a){
-  return builtin_ord(e, a, ">");
+  return builtin_ord(e, a, LOP_GT);
 }
 lval* builtin_lt(lenv* e, lval* a){
-  return builtin_ord(e, a, "<");
+  return builtin_ord(e, a, LOP_LT);
 }
 lval* builtin_ge(lenv* e, lval* a){
-  return builtin_ord(e, a, ">=");
+  return builtin_ord(e, a, LOP_GE);
 }
 lval* builtin_le(lenv* e, lval* a){
-  return builtin_ord(e, a, "<=");
+  return builtin_ord(e, a, LOP_LE);
 }
 
 int lval_eq(lval* x, lval* y) {
+  // 整数和浮点数按数值比较
+  if ((x->lisptype == LVAL_DBL) != (y->lisptype == LVAL_DBL)
+      && (x->lisptype == LVAL_NUM || x->lisptype == LVAL_BIG
+          || y->lisptype == LVAL_NUM || y->lisptype == LVAL_BIG)) {
+    return lval_to_dbl(x) == lval_to_dbl(y);
+  }
   if (x->lisptype != y->lisptype) {return 0;}
 
   switch (x->lisptype)
   {
   case LVAL_NUM:
     return (x->lnum == y->lnum);
+  case LVAL_DBL:
+    return (x->dnum == y->dnum);
+  case LVAL_BIG:
+    return lbig_cmp(x->big, y->big) == 0;
+  case LVAL_VEC:
+    return lvec_eq(x->vec, y->vec);
   case LVAL_ERR:
     return (strcmp(x->err, y->err) == 0);
   case LVAL_SYM:
-    return (strcmp(x->sym, y->sym) == 0);
+    return (x->sym == y->sym);
+  case LVAL_STR:
+    return (strcmp(x->str, y->str) == 0);
   case LVAL_FUN:
     if (x->builtin || y->builtin) {
       return x->builtin == y->builtin;
     } else {
       return lval_eq(x->formals, y->formals) 
-              && lval_eq(x->body, y->body);
+              && lval_eq(x->code->body, y->code->body);
     }
   case LVAL_QEXPR:
   case LVAL_SEXPR:
@@ -957,24 +2093,19 @@ int lval_eq(lval* x, lval* y) {
   return 0;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
-  }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
-  }
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+  LASSERT_NUM(lop_name[op], a, 2);
+  int r = lval_eq(a->cell[0], a->cell[1]);
+  if (op == LOP_NE) { r = !r; }
   lval_del(a);
   return lval_num(r);
 }
 
 lval* builtin_eq(lenv* e, lval* a){
-  return builtin_cmp(e, a, "==");
+  return builtin_cmp(e, a, LOP_EQ);
 }
 lval* builtin_ne(lenv* e, lval* a){
-  return builtin_cmp(e, a, "!=");
+  return builtin_cmp(e, a, LOP_NE);
 }
 
 lval* builtin_if(lenv* e, lval* a) {
@@ -984,16 +2115,2040 @@ lval* builtin_if(lenv* e, lval* a) {
   LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
   lval* x;
-  a->cell[1]->lisptype = LVAL_SEXPR;
-  a->cell[2]->lisptype = LVAL_SEXPR;
-
   if (a->cell[0]->lnum) {
-    x = lval_eval(e, lval_pop(a, 1));
+    x = lval_own(lval_pop(a, 1));
   } else {
-    x = lval_eval(e, lval_pop(a, 2));
+    x = lval_own(lval_pop(a, 2));
   }
+  x->lisptype = LVAL_SEXPR;
   lval_del(a);
-  return x;
+  return lval_eval(e, x);
+}
+
+
+
+
+// =====================VM======================
+
+// 求值栈, 所有vm_exec调用共享
+lval** vm_stack = NULL;
+int vm_sp = 0;
+int vm_cap = 0;
+
+void lcode_emit(lcode* c, int op) {
+  c->count++;
+  c->ops = realloc(c->ops, sizeof(int) * c->count);
+  c->ops[c->count-1] = op;
+}
+
+// 添加常量, 返回其索引
+int lcode_const(lcode* c, lval* x) {
+  c->nconst++;
+  c->consts = realloc(c->consts, sizeof(lval*) * c->nconst);
+  c->consts[c->nconst-1] = lval_copy(x);
+  return c->nconst-1;
+}
+
+void lcode_push(lcode* c, int n) {
+  c->sp += n;
+  if (c->sp > c->maxstack) { c->maxstack = c->sp; }
+}
+
+// Compile a Q-Expression body into bytecode
+lcode* lcode_compile(lval* formals, lval* body) {
+  lcode* c = malloc(sizeof(lcode));
+  c->ref = 1;
+  c->body = body;
+  c->ops = NULL;
+  c->count = 0;
+  c->consts = NULL;
+  c->nconst = 0;
+  c->sp = 0;
+  c->maxstack = 0;
+  // 形式参数按顺序绑定在调用环境的前几个位置,
+  // 有重名时位置无法确定, 全部按名字查找
+  c->locals = formals;
+  for (int i = 0; i < formals->count; i++) {
+    for (int j = 0; j < i; j++) {
+      if (formals->cell[i]->sym == formals->cell[j]->sym) { c->locals = NULL; }
+    }
+  }
+  // 函数体按S-表达式求值, 处于尾部位置
+  lcode_compile_list(c, body, 1);
+  lcode_emit(c, OP_RETURN);
+  c->locals = NULL;
+  return c;
+}
+
+void lcode_del(lcode* c) {
+  if (--c->ref > 0) { return; }
+  for (int i = 0; i < c->nconst; i++) {
+    lval_del(c->consts[i]);
+  }
+  free(c->consts);
+  free(c->ops);
+  lval_del(c->body);
+  free(c);
+}
+
+// Slot of a formal argument in the call environment, -1 if sym is not one.
+// 作用域是动态的, 只有函数自己的参数能在编译时确定位置
+int lcode_local(lcode* c, char* sym) {
+  if (!c->locals) { return -1; }
+  int slot = 0;
+  for (int i = 0; i < c->locals->count; i++) {
+    if (c->locals->cell[i]->sym == lsym_and) { continue; }
+    if (c->locals->cell[i]->sym == sym) { return slot; }
+    slot++;
+  }
+  return -1;
+}
+
+// tail: x的值就是函数的返回值, 调用可以复用当前栈帧
+void lcode_compile_expr(lcode* c, lval* x, int tail) {
+  switch (x->lisptype) {
+    case LVAL_SYM: {
+      int slot = lcode_local(c, x->sym);
+      if (slot >= 0) {
+        lcode_emit(c, OP_LOCAL);
+        lcode_emit(c, slot);
+      } else {
+        lcode_emit(c, OP_LOAD);
+        lcode_emit(c, lcode_const(c, x));
+      }
+      lcode_push(c, 1);
+      break;
+    }
+    case LVAL_SEXPR:
+      lcode_compile_list(c, x, tail);
+      break;
+    default:
+      // Numbers and Q-Expressions evaluate to themselves
+      lcode_emit(c, OP_CONST);
+      lcode_emit(c, lcode_const(c, x));
+      lcode_push(c, 1);
+      break;
+  }
+}
+
+// Compile the cells of v as an S-Expression, same rules as lval_eval_sexpr
+void lcode_compile_list(lcode* c, lval* v, int tail) {
+  // Empty Expression
+  if (v->count == 0) {
+    lval* x = lval_sexpr();
+    lcode_emit(c, OP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    lcode_push(c, 1);
+    lval_del(x);
+    return;
+  }
+  // Single Exprssion
+  if (v->count == 1) {
+    lcode_compile_expr(c, v->cell[0], tail);
+    return;
+  }
+  // (if cond {then} {else}) 内联为跳转.
+  // 运行时'if'可能已被重新定义, 此时退回到普通调用
+  if (v->count == 4
+      && v->cell[0]->lisptype == LVAL_SYM
+      && v->cell[0]->sym == lsym_if
+      && v->cell[2]->lisptype == LVAL_QEXPR
+      && v->cell[3]->lisptype == LVAL_QEXPR) {
+    int base = c->sp;
+    lcode_compile_expr(c, v->cell[0], 0);
+    lcode_compile_expr(c, v->cell[1], 0);
+    lcode_emit(c, OP_BRANCH);
+    int branch = c->count;
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+
+    c->sp = base;
+    lcode_compile_list(c, v->cell[2], tail);
+    lcode_emit(c, OP_JUMP);
+    int then_end = c->count;
+    lcode_emit(c, 0);
+
+    c->ops[branch] = c->count;
+    c->sp = base;
+    lcode_compile_list(c, v->cell[3], tail);
+    lcode_emit(c, OP_JUMP);
+    int else_end = c->count;
+    lcode_emit(c, 0);
+
+    c->ops[branch+1] = c->count;
+    c->sp = base + 2;
+    lcode_compile_expr(c, v->cell[2], 0);
+    lcode_compile_expr(c, v->cell[3], 0);
+    lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+    lcode_emit(c, 4);
+    c->sp = base + 1;
+
+    c->ops[then_end] = c->count;
+    c->ops[else_end] = c->count;
+    return;
+  }
+  for (int i = 0; i < v->count; i++) {
+    lcode_compile_expr(c, v->cell[i], 0);
+  }
+  lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+  lcode_emit(c, v->count);
+  c->sp -= v->count - 1;
+}
+
+// 确保栈上还有n个空位
+void vm_reserve(int n) {
+  if (vm_sp + n > vm_cap) {
+    while (vm_sp + n > vm_cap) { vm_cap = vm_cap ? vm_cap * 2 : 256; }
+    vm_stack = realloc(vm_stack, sizeof(lval*) * vm_cap);
+  }
+}
+
+lval* vm_exec(lenv* e, lcode* c) {
+  // 尾调用后正在执行的函数, 由vm_exec自己持有
+  lval* fn = NULL;
+  vm_reserve(c->maxstack);
+  int pc = 0;
+  while (1) {
+    switch (c->ops[pc++]) {
+      case OP_CONST:
+        vm_stack[vm_sp++] = lval_copy(c->consts[c->ops[pc++]]);
+        break;
+      case OP_LOAD:
+        vm_stack[vm_sp++] = lenv_get(e, c->consts[c->ops[pc++]]);
+        break;
+      case OP_LOCAL:
+        vm_stack[vm_sp++] = lval_copy(e->vals[c->ops[pc++]]);
+        break;
+      case OP_CALL: {
+        int n = c->ops[pc++];
+        vm_sp -= n;
+        // vm_call可能会扩展栈, 所以之后再写入结果
+        lval* r = vm_call(e, &vm_stack[vm_sp], n);
+        vm_stack[vm_sp++] = r;
+        break;
+      }
+      case OP_TAILCALL: {
+        int n = c->ops[pc++];
+        vm_sp -= n;
+        lval** xs = &vm_stack[vm_sp];
+        int ok = xs[0]->lisptype == LVAL_FUN && !xs[0]->builtin;
+        for (int i = 0; i < n; i++) {
+          if (xs[i]->lisptype == LVAL_ERR) { ok = 0; }
+        }
+        // 内置函数和出错的情况按普通调用处理
+        if (!ok) {
+          lval* r = vm_call(e, xs, n);
+          vm_stack[vm_sp++] = r;
+          break;
+        }
+        lval* a = lval_expr_new(LVAL_SEXPR, n-1);
+        memcpy(a->cell, xs+1, sizeof(lval*) * a->count);
+        lval* f = lval_bind(e, xs[0], a);
+        if (f->lisptype == LVAL_ERR || f->formals->count > 0) {
+          vm_stack[vm_sp++] = f;
+          break;
+        }
+        // 作用域是动态的, 新函数仍可能访问当前栈帧中的变量.
+        // 把没有被遮蔽的绑定复制过去, 就可以丢弃当前栈帧, 在原地执行新函数.
+        // 复制的绑定不超过循环中出现的不同参数名, 栈帧大小保持不变
+        lenv_inherit(f->env, e);
+        f->env->par = e->par;
+        if (fn) { lval_del(fn); }
+        fn = f;
+        e = f->env;
+        c = f->code;
+        pc = 0;
+        vm_reserve(c->maxstack);
+        break;
+      }
+      case OP_BRANCH: {
+        lval* f = vm_stack[vm_sp-2];
+        lval* cond = vm_stack[vm_sp-1];
+        if (f->lisptype != LVAL_FUN || f->builtin != builtin_if
+            || cond->lisptype != LVAL_NUM) {
+          pc = c->ops[pc+1];
+          break;
+        }
+        pc = cond->lnum ? pc + 2 : c->ops[pc];
+        lval_del(f);
+        lval_del(cond);
+        vm_sp -= 2;
+        break;
+      }
+      case OP_JUMP:
+        pc = c->ops[pc];
+        break;
+      case OP_RETURN: {
+        lval* r = vm_stack[--vm_sp];
+        if (fn) { lval_del(fn); }
+        return r;
+      }
+    }
+  }
+}
+
+// Apply evaluated S-Expression cells xs[0..n-1], consumes them
+lval* vm_call(lenv* e, lval** xs, int n) {
+  lval* v = lval_expr_new(LVAL_SEXPR, n);
+  memcpy(v->cell, xs, sizeof(lval*) * n);
+  return lval_sexpr_call(e, v);
+}
+
+
+// ====================MEMORY===================
+
+// lval和lenv各自使用一个定长对象池, 释放的对象挂回空闲链表,
+// 不归还给系统. 解释器是单线程的, 空闲链表就是普通的全局变量
+lslot* lval_pool[LSIZE_COUNT];
+lslot* lenv_pool = NULL;
+
+void* slab_alloc(lslot** list, size_t size) {
+  if (!*list) {
+    // 申请一整块并切分成对象
+    char* slab = malloc(size * SLAB_OBJECTS);
+    lisp_stats.slab_bytes += size * SLAB_OBJECTS;
+    for (int i = SLAB_OBJECTS-1; i >= 0; i--) {
+      slab_free(list, slab + i * size);
+    }
+  }
+  lslot* s = *list;
+  *list = s->next;
+  return s;
+}
+
+void slab_free(lslot** list, void* p) {
+  lslot* s = p;
+  s->next = *list;
+  *list = s;
+}
+
+// 按类型选择大小类别
+int lval_size(int type) {
+  switch (type) {
+    case LVAL_FUN: return LSIZE_FUN;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: return LSIZE_EXPR;
+    default: return LSIZE_NUM;
+  }
+}
+
+// 每个大小类别的对象字节数, 保持指针对齐
+size_t lval_bytes[LSIZE_COUNT] = {
+  (offsetof(lval, lnum) + sizeof(long) + 7) & ~7,
+  (offsetof(lval, buf) + sizeof(lbuf*) + 7) & ~7,
+  sizeof(lval),
+};
+
+lval* lval_alloc(int type) {
+  int size = lval_size(type);
+  lisp_stats.lval_total++;
+  lisp_stats.lval_bytes += lval_bytes[size];
+  if (++lisp_stats.lval_live > lisp_stats.lval_peak) {
+    lisp_stats.lval_peak = lisp_stats.lval_live;
+  }
+  return slab_alloc(&lval_pool[size], lval_bytes[size]);
+}
+
+void lval_free(lval* v) {
+  int size = lval_size(v->lisptype);
+  lisp_stats.lval_live--;
+  lisp_stats.lval_bytes -= lval_bytes[size];
+  slab_free(&lval_pool[size], v);
+}
+
+void lval_small_init(void) {
+  for (int i = LVAL_SMALL_MIN; i <= LVAL_SMALL_MAX; i++) {
+    lval* v = &lval_small[i - LVAL_SMALL_MIN];
+    v->lisptype = LVAL_NUM;
+    v->ref = LVAL_IMMORTAL;
+    v->lnum = i;
+  }
+}
+
+lenv* lenv_alloc(void) {
+  lisp_stats.lenv_total++;
+  if (++lisp_stats.lenv_live > lisp_stats.lenv_peak) {
+    lisp_stats.lenv_peak = lisp_stats.lenv_live;
+  }
+  return slab_alloc(&lenv_pool, sizeof(lenv));
+}
+
+void lenv_free(lenv* e) {
+  lisp_stats.lenv_live--;
+  slab_free(&lenv_pool, e);
+}
+
+// 打印内存使用情况, 参数会被忽略: (stats ())
+lval* builtin_stats(lenv* e, lval* a) {
+  printf("lval: %ld live, %ld peak, %ld allocated, %ld bytes\n",
+    lisp_stats.lval_live, lisp_stats.lval_peak, lisp_stats.lval_total,
+    lisp_stats.lval_bytes);
+  printf("lenv: %ld live, %ld peak, %ld allocated, %ld bytes\n",
+    lisp_stats.lenv_live, lisp_stats.lenv_peak, lisp_stats.lenv_total,
+    lisp_stats.lenv_live * (long)sizeof(lenv));
+  printf("slab: %ld bytes\n", lisp_stats.slab_bytes);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+
+// ====================SYMBOL===================
+
+// FNV-1a over the n bytes at s
+unsigned long lsym_hash(char* s, int n) {
+  unsigned long h = 14695981039346656037UL;
+  for (int i = 0; i < n; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+// Find or create the unique Symbol lval named s
+lval* lsym_intern(char* s) {
+  return lsym_intern_n(s, strlen(s));
+}
+
+// Same as lsym_intern for the n bytes at s, which need not end in '\0'
+lval* lsym_intern_n(char* s, int n) {
+  // 保持装载率低于1/2
+  if (lsym_table.count * 2 >= lsym_table.cap) {
+    int cap = lsym_table.cap ? lsym_table.cap * 2 : 256;
+    lval** items = calloc(cap, sizeof(lval*));
+    for (int i = 0; i < lsym_table.cap; i++) {
+      lval* x = lsym_table.items[i];
+      if (!x) { continue; }
+      unsigned long j = lsym_hash(x->sym, strlen(x->sym)) & (cap - 1);
+      while (items[j]) { j = (j + 1) & (cap - 1); }
+      items[j] = x;
+    }
+    free(lsym_table.items);
+    lsym_table.items = items;
+    lsym_table.cap = cap;
+  }
+  unsigned long i = lsym_hash(s, n) & (lsym_table.cap - 1);
+  while (lsym_table.items[i]) {
+    char* sym = lsym_table.items[i]->sym;
+    if (strncmp(sym, s, n) == 0 && sym[n] == '\0') {
+      return lsym_table.items[i];
+    }
+    i = (i + 1) & (lsym_table.cap - 1);
+  }
+  lval* v = lval_alloc(LVAL_SYM);
+  v->ref = LVAL_IMMORTAL;
+  v->lisptype = LVAL_SYM;
+  v->sym = malloc(n + 1);
+  memcpy(v->sym, s, n);
+  v->sym[n] = '\0';
+  lsym_table.items[i] = v;
+  lsym_table.count++;
+  return v;
+}
+
+void lsym_init(void) {
+  lsym_and = lsym_intern("&")->sym;
+  lsym_if = lsym_intern("if")->sym;
+}
+
+
+// =====================LIST====================
+
+lbuf* lbuf_new(int cap) {
+  lbuf* b = malloc(sizeof(lbuf) + sizeof(lval*) * cap);
+  b->ref = 1;
+  b->lo = 0;
+  b->hi = 0;
+  b->cap = cap;
+  return b;
+}
+
+void lbuf_del(lbuf* b) {
+  if (--b->ref > 0) { return; }
+  for (int i = b->lo; i < b->hi; i++) {
+    lval_del(b->items[i]);
+  }
+  free(b);
+}
+
+// New S-/Q-Expression with n cells, the caller fills in every cell
+lval* lval_expr_new(int type, int n) {
+  lval* v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+  if (n == 0) { return v; }
+  v->buf = lbuf_new(n);
+  v->buf->hi = n;
+  v->cell = v->buf->items;
+  v->count = n;
+  return v;
+}
+
+// Move the cells of b to the front and change its capacity
+lbuf* lbuf_resize(lbuf* b, int cap) {
+  int count = b->hi - b->lo;
+  memmove(b->items, b->items + b->lo, sizeof(lval*) * count);
+  b->lo = 0;
+  b->hi = count;
+  b->cap = cap;
+  return realloc(b, sizeof(lbuf) + sizeof(lval*) * cap);
+}
+
+// Make room for n more cells at the end of v, the cells may stay shared
+void lval_cells_reserve(lval* v, int n) {
+  lbuf* b = v->buf;
+  // 切片一直延伸到数组末尾并且还有空位时, 即使数组是共享的也可以原地追加:
+  // 其他切片看不到hi之后的位置, 追加后hi后移, 它们就不能再这样追加了
+  if (b && b->ref > 1 && v->cell + v->count == b->items + b->hi
+      && b->hi + n <= b->cap) {
+    return;
+  }
+  lval_cells_own(v);
+  b = v->buf;
+  if (!b) {
+    b = lbuf_new(n < 4 ? 4 : n);
+  } else if (b->hi + n > b->cap) {
+    int count = b->hi - b->lo;
+    if (b->lo > 0 && count + n <= b->cap / 2) {
+      // 前面空出的位置足够多, 移到开头即可
+      b = lbuf_resize(b, b->cap);
+    } else {
+      // 容量成倍增长, 追加的均摊代价为O(1)
+      int cap = b->cap ? b->cap * 2 : 4;
+      while (cap < count + n) { cap *= 2; }
+      b = lbuf_resize(b, cap);
+    }
+  }
+  v->buf = b;
+  v->cell = b->items + b->lo;
+}
+
+// Make v the only owner of its cells so they can be changed in place.
+// v itself must already be owned (lval_own)
+void lval_cells_own(lval* v) {
+  lbuf* b = v->buf;
+  if (!b) { return; }
+  if (b->ref > 1) {
+    // 其他列表也在使用这个数组, 复制自己的那一段
+    lbuf* n = lbuf_new(v->count);
+    for (int i = 0; i < v->count; i++) {
+      n->items[i] = lval_copy(v->cell[i]);
+    }
+    n->hi = v->count;
+    b->ref--;
+    v->buf = n;
+    v->cell = n->items;
+    return;
+  }
+  // 释放切片之外的元素
+  int lo = v->cell - b->items;
+  for (int i = b->lo; i < lo; i++) { lval_del(b->items[i]); }
+  for (int i = lo + v->count; i < b->hi; i++) { lval_del(b->items[i]); }
+  b->lo = lo;
+  b->hi = lo + v->count;
+}
+
+
+// ====================BIGNUM===================
+
+lbig* lbig_new(int count) {
+  lbig* b = malloc(sizeof(lbig) + sizeof(uint32_t) * count);
+  b->sign = 1;
+  b->count = count;
+  return b;
+}
+
+// 去掉高位的0
+lbig* lbig_trim(lbig* b) {
+  while (b->count > 0 && b->d[b->count-1] == 0) { b->count--; }
+  if (b->count == 0) { b->sign = 1; }
+  return b;
+}
+
+lbig* lbig_from_long(long x) {
+  lbig* b = lbig_new(2);
+  unsigned long m = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  b->sign = x < 0 ? -1 : 1;
+  b->d[0] = (uint32_t)m;
+  b->d[1] = (uint32_t)(m >> 32);
+  return lbig_trim(b);
+}
+
+lbig* lbig_copy(lbig* b) {
+  lbig* c = lbig_new(b->count);
+  c->sign = b->sign;
+  memcpy(c->d, b->d, sizeof(uint32_t) * b->count);
+  return c;
+}
+
+// New big integer with the value of a Number or Big Number
+lbig* lbig_of(lval* x) {
+  if (x->lisptype == LVAL_NUM) { return lbig_from_long(x->lnum); }
+  return lbig_copy(x->big);
+}
+
+// Store b in x if it fits in a long
+int lbig_to_long(lbig* b, long* x) {
+  if (b->count > 2) { return 0; }
+  unsigned long m = 0;
+  if (b->count > 0) { m = b->d[0]; }
+  if (b->count > 1) { m |= (unsigned long)b->d[1] << 32; }
+  if (b->sign > 0) {
+    if (m > LONG_MAX) { return 0; }
+    *x = (long)m;
+  } else {
+    if (m > (unsigned long)LONG_MAX + 1) { return 0; }
+    *x = m ? -(long)(m - 1) - 1 : 0;
+  }
+  return 1;
+}
+
+double lbig_to_dbl(lbig* b) {
+  double r = 0;
+  for (int i = b->count-1; i >= 0; i--) {
+    r = r * 4294967296.0 + b->d[i];
+  }
+  return b->sign * r;
+}
+
+// Parse an optionally signed string of decimal digits
+lbig* lbig_read(char* s) {
+  int sign = 1;
+  if (*s == '-') { sign = -1; s++; }
+  int len = strlen(s);
+  // 每段至少能放下9位十进制数
+  lbig* b = lbig_new(len / 9 + 1);
+  b->count = 0;
+  // 每次读入9位: b = b * 10^k + chunk
+  while (*s) {
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int k = 0; k < 9 && *s; k++, s++) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+    uint64_t carry = chunk;
+    for (int i = 0; i < b->count; i++) {
+      carry += (uint64_t)b->d[i] * scale;
+      b->d[i] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry) { b->d[b->count++] = (uint32_t)carry; }
+  }
+  b->sign = sign;
+  return lbig_trim(b);
+}
+
+// Decimal representation of b, the caller frees it
+char* lbig_str(lbig* b) {
+  // 反复除以10^9, 每次得到低9位
+  int n = b->count;
+  uint32_t* t = malloc(sizeof(uint32_t) * (n ? n : 1));
+  memcpy(t, b->d, sizeof(uint32_t) * n);
+  int len = n * 10 + 2;
+  char* s = malloc(len);
+  int p = len - 1;
+  s[p] = '\0';
+  while (n > 0) {
+    uint64_t rem = 0;
+    for (int i = n-1; i >= 0; i--) {
+      uint64_t cur = (rem << 32) | t[i];
+      t[i] = (uint32_t)(cur / 1000000000);
+      rem = cur % 1000000000;
+    }
+    while (n > 0 && t[n-1] == 0) { n--; }
+    for (int k = 0; k < 9 && (n > 0 || rem); k++) {
+      s[--p] = '0' + rem % 10;
+      rem /= 10;
+    }
+  }
+  if (p == len - 1) { s[--p] = '0'; }
+  if (b->sign < 0 && b->count > 0) { s[--p] = '-'; }
+  memmove(s, s + p, len - p);
+  free(t);
+  return s;
+}
+
+int lbig_cmp_mag(lbig* a, lbig* b) {
+  if (a->count != b->count) { return a->count < b->count ? -1 : 1; }
+  for (int i = a->count-1; i >= 0; i--) {
+    if (a->d[i] != b->d[i]) { return a->d[i] < b->d[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+int lbig_cmp(lbig* a, lbig* b) {
+  if (a->sign != b->sign) { return a->sign; }
+  return a->sign * lbig_cmp_mag(a, b);
+}
+
+// r[0, nr) += a[0, na), nr >= na. Returns the carry out of r
+uint32_t lbig_add_raw(uint32_t* r, int nr, uint32_t* a, int na) {
+  uint64_t carry = 0;
+  int i = 0;
+  for (; i < na; i++) {
+    carry += (uint64_t)r[i] + a[i];
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  for (; carry && i < nr; i++) {
+    carry += r[i];
+    r[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  return (uint32_t)carry;
+}
+
+// r[0, nr) -= a[0, na), r must not be smaller than a
+void lbig_sub_raw(uint32_t* r, int nr, uint32_t* a, int na) {
+  int64_t borrow = 0;
+  int i = 0;
+  for (; i < na; i++) {
+    borrow += (int64_t)r[i] - a[i];
+    r[i] = (uint32_t)borrow;
+    borrow >>= 32;
+  }
+  for (; borrow && i < nr; i++) {
+    borrow += r[i];
+    r[i] = (uint32_t)borrow;
+    borrow >>= 32;
+  }
 }
 
+// a + bsign * b
+lbig* lbig_add(lbig* a, lbig* b, int bsign) {
+  int sb = b->sign * bsign;
+  if (a->sign == sb) {
+    if (a->count < b->count) { lbig* t = a; a = b; b = t; }
+    lbig* r = lbig_new(a->count + 1);
+    memcpy(r->d, a->d, sizeof(uint32_t) * a->count);
+    r->d[a->count] = lbig_add_raw(r->d, a->count, b->d, b->count);
+    r->sign = sb;
+    return lbig_trim(r);
+  }
+  // 符号不同, 大的绝对值减去小的
+  int sa = a->sign;
+  if (lbig_cmp_mag(a, b) < 0) { lbig* t = a; a = b; b = t; sa = sb; }
+  lbig* r = lbig_new(a->count);
+  memcpy(r->d, a->d, sizeof(uint32_t) * a->count);
+  lbig_sub_raw(r->d, r->count, b->d, b->count);
+  r->sign = sa;
+  return lbig_trim(r);
+}
 
+// r[0, na+nb) = a * b, r must be zeroed and must not overlap a or b
+void lbig_mul_raw(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
+  }
+  while (nb > 0 && b[nb-1] == 0) { nb--; }
+  if (nb < LBIG_KARATSUBA) {
+    for (int j = 0; j < nb; j++) {
+      uint64_t carry = 0;
+      for (int i = 0; i < na; i++) {
+        carry += (uint64_t)a[i] * b[j] + r[i+j];
+        r[i+j] = (uint32_t)carry;
+        carry >>= 32;
+      }
+      r[na+j] = (uint32_t)carry;
+    }
+    return;
+  }
+  if (nb <= na / 2) {
+    // 长度相差太多时把a切成nb段, 每段与b做Karatsuba乘法
+    uint32_t* t = malloc(sizeof(uint32_t) * 2 * nb);
+    for (int i = 0; i < na; i += nb) {
+      int k = na - i < nb ? na - i : nb;
+      memset(t, 0, sizeof(uint32_t) * (k + nb));
+      lbig_mul_raw(t, a + i, k, b, nb);
+      lbig_add_raw(r + i, na + nb - i, t, k + nb);
+    }
+    free(t);
+    return;
+  }
+  // a = a1*B^m + a0, b = b1*B^m + b0
+  // a*b = z2*B^2m + (z1 - z2 - z0)*B^m + z0, z1 = (a0+a1)(b0+b1)
+  int m = na / 2;
+  int n1 = na - m;
+  int nsa = n1 + 1;
+  int nsb = (nb - m > m ? nb - m : m) + 1;
+  uint32_t* sa = calloc(nsa + nsb + nsa + nsb, sizeof(uint32_t));
+  uint32_t* sb = sa + nsa;
+  uint32_t* z1 = sb + nsb;
+  memcpy(sa, a + m, sizeof(uint32_t) * n1);
+  lbig_add_raw(sa, nsa, a, m);
+  memcpy(sb, b, sizeof(uint32_t) * m);
+  lbig_add_raw(sb, nsb, b + m, nb - m);
+  // z0和z2直接写到结果中互不重叠的两段
+  lbig_mul_raw(r, a, m, b, m);
+  lbig_mul_raw(r + 2*m, a + m, n1, b + m, nb - m);
+  lbig_mul_raw(z1, sa, nsa, sb, nsb);
+  lbig_sub_raw(z1, nsa + nsb, r, 2*m);
+  lbig_sub_raw(z1, nsa + nsb, r + 2*m, na + nb - 2*m);
+  int nz = nsa + nsb;
+  while (nz > 0 && z1[nz-1] == 0) { nz--; }
+  lbig_add_raw(r + m, na + nb - m, z1, nz);
+  free(sa);
+}
+
+lbig* lbig_mul(lbig* a, lbig* b) {
+  lbig* r = lbig_new(a->count + b->count);
+  memset(r->d, 0, sizeof(uint32_t) * r->count);
+  lbig_mul_raw(r->d, a->d, a->count, b->d, b->count);
+  r->sign = a->sign * b->sign;
+  return lbig_trim(r);
+}
+
+// Truncating division like C: q = a / b, r = a % b. b must not be 0
+void lbig_divmod(lbig* a, lbig* b, lbig** q, lbig** r) {
+  int n = b->count;
+  int m = a->count;
+  if (lbig_cmp_mag(a, b) < 0) {
+    *q = lbig_new(0);
+    *r = lbig_new(m);
+    memcpy((*r)->d, a->d, sizeof(uint32_t) * m);
+    (*r)->sign = a->sign;
+    lbig_trim(*r);
+    return;
+  }
+  lbig* qq = lbig_new(m - n + 1);
+  lbig* rr = lbig_new(n);
+  if (n == 1) {
+    uint64_t rem = 0;
+    for (int i = m-1; i >= 0; i--) {
+      uint64_t cur = (rem << 32) | a->d[i];
+      qq->d[i] = (uint32_t)(cur / b->d[0]);
+      rem = cur % b->d[0];
+    }
+    rr->d[0] = (uint32_t)rem;
+  } else {
+    // Knuth算法D: 先左移使除数最高位为1, 这样估计的商最多大2
+    int s = __builtin_clz(b->d[n-1]);
+    uint32_t* vn = malloc(sizeof(uint32_t) * (n + m + 1));
+    uint32_t* un = vn + n;
+    for (int i = n-1; i > 0; i--) {
+      vn[i] = (b->d[i] << s) | (uint32_t)((uint64_t)b->d[i-1] >> (32 - s));
+    }
+    vn[0] = b->d[0] << s;
+    un[m] = (uint32_t)((uint64_t)a->d[m-1] >> (32 - s));
+    for (int i = m-1; i > 0; i--) {
+      un[i] = (a->d[i] << s) | (uint32_t)((uint64_t)a->d[i-1] >> (32 - s));
+    }
+    un[0] = a->d[0] << s;
+    for (int j = m - n; j >= 0; j--) {
+      uint64_t num = ((uint64_t)un[j+n] << 32) | un[j+n-1];
+      uint64_t qhat = num / vn[n-1];
+      uint64_t rhat = num % vn[n-1];
+      while (qhat >> 32
+             || qhat * vn[n-2] > ((rhat << 32) | un[j+n-2])) {
+        qhat--;
+        rhat += vn[n-1];
+        if (rhat >> 32) { break; }
+      }
+      // un[j, j+n] -= qhat * vn
+      int64_t k = 0;
+      int64_t t;
+      for (int i = 0; i < n; i++) {
+        uint64_t p = qhat * vn[i];
+        t = (int64_t)un[i+j] - k - (int64_t)(p & 0xFFFFFFFF);
+        un[i+j] = (uint32_t)t;
+        k = (int64_t)(p >> 32) - (t >> 32);
+      }
+      t = (int64_t)un[j+n] - k;
+      un[j+n] = (uint32_t)t;
+      qq->d[j] = (uint32_t)qhat;
+      // 估计大了1, 加回一个除数
+      if (t < 0) {
+        qq->d[j]--;
+        uint64_t c = 0;
+        for (int i = 0; i < n; i++) {
+          c += (uint64_t)un[i+j] + vn[i];
+          un[i+j] = (uint32_t)c;
+          c >>= 32;
+        }
+        un[j+n] += (uint32_t)c;
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      rr->d[i] = (un[i] >> s) | (uint32_t)((uint64_t)un[i+1] << (32 - s));
+    }
+    free(vn);
+  }
+  qq->sign = a->sign * b->sign;
+  rr->sign = a->sign;
+  *q = lbig_trim(qq);
+  *r = lbig_trim(rr);
+}
+
+// a^n for n >= 0, 负指数在builtin_op_slow中已经按浮点数计算
+lbig* lbig_pow(lbig* a, long n) {
+  lbig* r = lbig_from_long(1);
+  lbig* b = lbig_copy(a);
+  while (n) {
+    if (n & 1) { lbig* t = lbig_mul(r, b); free(r); r = t; }
+    n >>= 1;
+    if (n) { lbig* t = lbig_mul(b, b); free(b); b = t; }
+  }
+  free(b);
+  return r;
+}
+
+
+// ====================VECTOR===================
+
+lvec* lvec_new(int count, int dbl) {
+  lvec* v = malloc(sizeof(lvec) + sizeof(v->items[0]) * count);
+  v->dbl = dbl;
+  v->count = count;
+  return v;
+}
+
+// Copy of v, with integer elements converted when dbl is set
+lvec* lvec_copy(lvec* v, int dbl) {
+  lvec* x = lvec_new(v->count, dbl || v->dbl);
+  if (x->dbl == v->dbl) {
+    memcpy(x->items, v->items, sizeof(v->items[0]) * v->count);
+  } else {
+    for (int i = 0; i < v->count; i++) { x->items[i].d = v->items[i].l; }
+  }
+  return x;
+}
+
+// A Number or Float is a one-element vector, it is broadcast by lvec_op
+lvec* lvec_of(lval* x, int dbl) {
+  if (x->lisptype == LVAL_VEC) { return lvec_copy(x->vec, dbl); }
+  lvec* v = lvec_new(1, dbl);
+  if (dbl) { v->items[0].d = lval_to_dbl(x); }
+  else { v->items[0].l = x->lnum; }
+  return v;
+}
+
+lval* lval_vec(lvec* v) {
+  lval* x = lval_alloc(LVAL_VEC);
+  x->ref = 1;
+  x->lisptype = LVAL_VEC;
+  x->vec = v;
+  return x;
+}
+
+lval* lvec_get(lvec* v, int i) {
+  return v->dbl ? lval_dbl(v->items[i].d) : lval_num(v->items[i].l);
+}
+
+void lvec_write(lout* o, lvec* v) {
+  lout_putc(o, '[');
+  for (int i = 0; i < v->count; i++) {
+    if (v->dbl) { lout_dbl(o, v->items[i].d); }
+    else { lout_long(o, v->items[i].l); }
+    if (i != v->count-1) { lout_putc(o, ' '); }
+  }
+  lout_putc(o, ']');
+}
+
+int lvec_eq(lvec* x, lvec* y) {
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->count; i++) {
+    if (x->dbl || y->dbl) {
+      double a = x->dbl ? x->items[i].d : x->items[i].l;
+      double b = y->dbl ? y->items[i].d : y->items[i].l;
+      if (a != b) { return 0; }
+    } else if (x->items[i].l != y->items[i].l) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// 逐个元素计算r[i] = r[i] OP y[i], y只有一个元素时与r的每个元素计算
+#define LVEC_MAP(f, OP) \
+  if (y->count == 1) { \
+    for (int i = 0; i < n; i++) { OP(r->items[i].f, y->items[0].f); } \
+  } else { \
+    for (int i = 0; i < n; i++) { OP(r->items[i].f, y->items[i].f); } \
+  }
+
+#define LVEC_DIV_OP(acc, y) \
+  if (y == 0) { div0 = 1; } \
+  else if (y == -1) { ovf |= __builtin_sub_overflow(0, acc, &acc); } \
+  else { acc /= y; }
+#define LVEC_MOD_OP(acc, y) \
+  if (y == 0) { div0 = 1; } else if (y == -1) { acc = 0; } else { acc %= y; }
+#define LVEC_POW_OP(acc, y) \
+  if (y < 0) { negexp = 1; } else { acc = lop_pow(acc, y, &ovf); }
+
+#define LVEC_DADD_OP(acc, y) acc += y
+#define LVEC_DSUB_OP(acc, y) acc -= y
+#define LVEC_DMUL_OP(acc, y) acc *= y
+#define LVEC_DDIV_OP(acc, y) if (y == 0) { div0 = 1; } else { acc /= y; }
+#define LVEC_DMOD_OP(acc, y) if (y == 0) { div0 = 1; } else { acc = fmod(acc, y); }
+#define LVEC_DPOW_OP(acc, y) acc = pow(acc, y)
+
+// Apply op element-wise to r in place, y has the same element type.
+// Returns an error message or NULL
+char* lvec_op(lvec* r, lvec* y, int op) {
+  int n = r->count;
+  int ovf = 0;
+  int div0 = 0;
+  int negexp = 0;
+  if (r->dbl) {
+    switch (op) {
+      case LOP_ADD: LVEC_MAP(d, LVEC_DADD_OP); break;
+      case LOP_SUB: LVEC_MAP(d, LVEC_DSUB_OP); break;
+      case LOP_MUL: LVEC_MAP(d, LVEC_DMUL_OP); break;
+      case LOP_DIV: LVEC_MAP(d, LVEC_DDIV_OP); break;
+      case LOP_MOD: LVEC_MAP(d, LVEC_DMOD_OP); break;
+      case LOP_POW: LVEC_MAP(d, LVEC_DPOW_OP); break;
+      case LOP_MIN: LVEC_MAP(d, LOP_MIN_OP); break;
+      case LOP_MAX: LVEC_MAP(d, LOP_MAX_OP); break;
+    }
+  } else {
+    switch (op) {
+      case LOP_ADD: LVEC_MAP(l, LOP_ADD_OP); break;
+      case LOP_SUB: LVEC_MAP(l, LOP_SUB_OP); break;
+      case LOP_MUL: LVEC_MAP(l, LOP_MUL_OP); break;
+      case LOP_DIV: LVEC_MAP(l, LVEC_DIV_OP); break;
+      case LOP_MOD: LVEC_MAP(l, LVEC_MOD_OP); break;
+      case LOP_POW: LVEC_MAP(l, LVEC_POW_OP); break;
+      case LOP_MIN: LVEC_MAP(l, LOP_MIN_OP); break;
+      case LOP_MAX: LVEC_MAP(l, LOP_MAX_OP); break;
+    }
+  }
+  if (div0) { return "Division By Zero!"; }
+  if (negexp) { return "Negative Exponent In Integer Vector!"; }
+  // 向量的元素是定长的, 不会提升为大整数
+  if (ovf) { return "Integer Overflow In Vector!"; }
+  return NULL;
+}
+
+// builtin_op when some argument is a Vector: element-wise, numbers are broadcast
+lval* builtin_op_vec(lenv* e, lval* a, int op) {
+  int n = -1;
+  int dbl = 0;
+  for (int i = 0; i < a->count; i++) {
+    lval* x = a->cell[i];
+    if (x->lisptype == LVAL_VEC) {
+      LASSERT(a, n < 0 || x->vec->count == n,
+        "Function '%s' passed vectors of different length. Got %i, Expected %i.",
+        lop_name[op], x->vec->count, n);
+      n = x->vec->count;
+      dbl |= x->vec->dbl;
+      continue;
+    }
+    LASSERT(a, x->lisptype == LVAL_NUM || x->lisptype == LVAL_DBL,
+      "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+      lop_name[op], i, ltype_name(x->lisptype), ltype_name(LVAL_VEC));
+    dbl |= x->lisptype == LVAL_DBL;
+  }
+  // 结果的长度与向量相同. 第一个参数是独占的向量时直接在它上面计算
+  lval* x0 = a->cell[0];
+  lvec* r;
+  if (x0->lisptype == LVAL_VEC && x0->vec->dbl == dbl
+      && x0->ref == 1 && a->buf->ref == 1) {
+    r = x0->vec;
+    x0->vec = NULL;
+  } else {
+    r = lvec_new(n, dbl);
+    lvec* x = lvec_of(x0, dbl);
+    for (int i = 0; i < n; i++) { r->items[i] = x->items[x->count == 1 ? 0 : i]; }
+    free(x);
+  }
+  if (op == LOP_SUB && a->count == 1) {
+    // 取反即0 - v, 全0的字节也是浮点数0
+    lvec* z = lvec_new(n, dbl);
+    memset(z->items, 0, sizeof(z->items[0]) * n);
+    char* err = lvec_op(z, r, LOP_SUB);
+    free(r);
+    r = z;
+    if (err) { free(r); lval_del(a); return lval_err(err); }
+  }
+  for (int i = 1; i < a->count; i++) {
+    // 元素类型相同的向量直接参与计算, 不必复制
+    lval* y = a->cell[i];
+    int tmp = y->lisptype != LVAL_VEC || y->vec->dbl != dbl;
+    lvec* yv = tmp ? lvec_of(y, dbl) : y->vec;
+    char* err = lvec_op(r, yv, op);
+    if (tmp) { free(yv); }
+    if (err) { free(r); lval_del(a); return lval_err(err); }
+  }
+  lval_del(a);
+  return lval_vec(r);
+}
+
+// Vector from a Q-Expression of Numbers and Floats: (vec {1 2 3})
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+  lval* q = a->cell[0];
+  int dbl = 0;
+  for (int i = 0; i < q->count; i++) {
+    int t = q->cell[i]->lisptype;
+    LASSERT(a, t == LVAL_NUM || t == LVAL_DBL,
+      "Function 'vec' passed incorrect type for element %i. Got %s, Expected %s.",
+      i, ltype_name(t), ltype_name(LVAL_NUM));
+    dbl |= t == LVAL_DBL;
+  }
+  lvec* v = lvec_new(q->count, dbl);
+  for (int i = 0; i < q->count; i++) {
+    if (dbl) { v->items[i].d = lval_to_dbl(q->cell[i]); }
+    else { v->items[i].l = q->cell[i]->lnum; }
+  }
+  lval_del(a);
+  return lval_vec(v);
+}
+
+// Elements of a vector as a Q-Expression
+lval* builtin_vlist(lenv* e, lval* a) {
+  LASSERT_NUM("vlist", a, 1);
+  LASSERT_TYPE("vlist", a, 0, LVAL_VEC);
+  lvec* v = a->cell[0]->vec;
+  lval* x = lval_expr_new(LVAL_QEXPR, v->count);
+  for (int i = 0; i < v->count; i++) { x->cell[i] = lvec_get(v, i); }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vlen(lenv* e, lval* a) {
+  LASSERT_NUM("vlen", a, 1);
+  LASSERT_TYPE("vlen", a, 0, LVAL_VEC);
+  lval* x = lval_num(a->cell[0]->vec->count);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vget(lenv* e, lval* a) {
+  LASSERT_NUM("vget", a, 2);
+  LASSERT_TYPE("vget", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vget", a, 1, LVAL_NUM);
+  LASSERT_INDEX("vget", a, 1, a->cell[0]->vec->count);
+  lval* x = lvec_get(a->cell[0]->vec, a->cell[1]->lnum);
+  lval_del(a);
+  return x;
+}
+
+// (vset v i x) returns v with element i replaced, v is copied if it is shared
+lval* builtin_vset(lenv* e, lval* a) {
+  LASSERT_NUM("vset", a, 3);
+  LASSERT_TYPE("vset", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vset", a, 1, LVAL_NUM);
+  LASSERT(a, a->cell[2]->lisptype == LVAL_NUM
+    || a->cell[2]->lisptype == LVAL_DBL,
+    "Function 'vset' passed incorrect type for argument 2. Got %s, Expected %s.",
+    ltype_name(a->cell[2]->lisptype), ltype_name(LVAL_NUM));
+  LASSERT_INDEX("vset", a, 1, a->cell[0]->vec->count);
+  long i = a->cell[1]->lnum;
+  lval* x = lval_pop(a, 2);
+  lval* v = lval_own(lval_pop(a, 0));
+  lval_del(a);
+  // 向整数向量中放入浮点数时整个向量转为浮点数
+  if (x->lisptype == LVAL_DBL && !v->vec->dbl) {
+    lvec* d = lvec_copy(v->vec, 1);
+    free(v->vec);
+    v->vec = d;
+  }
+  if (v->vec->dbl) { v->vec->items[i].d = lval_to_dbl(x); }
+  else { v->vec->items[i].l = x->lnum; }
+  lval_del(x);
+  return v;
+}
+
+// (vslice v lo hi) copies elements [lo, hi)
+lval* builtin_vslice(lenv* e, lval* a) {
+  LASSERT_NUM("vslice", a, 3);
+  LASSERT_TYPE("vslice", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vslice", a, 1, LVAL_NUM);
+  LASSERT_TYPE("vslice", a, 2, LVAL_NUM);
+  lvec* v = a->cell[0]->vec;
+  long lo = a->cell[1]->lnum;
+  long hi = a->cell[2]->lnum;
+  LASSERT(a, 0 <= lo && lo <= hi && hi <= v->count,
+    "Function 'vslice' passed range [%li, %li) outside [0, %i).",
+    lo, hi, v->count);
+  lvec* x = lvec_new(hi - lo, v->dbl);
+  memcpy(x->items, v->items + lo, sizeof(v->items[0]) * (hi - lo));
+  lval_del(a);
+  return lval_vec(x);
+}
+
+
+// ====================READER===================
+
+// 语法与原来的mpc文法相同:
+//   number : /-?[0-9]+\.?[0-9]*/
+//   symbol : /[a-zA-Z0-9_+\-*\/\\=<>!&%^]+/
+//   sexpr  : '(' <expr>* ')'
+//   qexpr  : '{' <expr>* '}'
+//   string : /"(\\\\.|[^"])*"/
+//   lispy  : /^/ <expr>* /$/
+// 每个字节只看一次, 不建语法树
+
+void lreader_init(lreader* r, char* name, char* s, size_t n) {
+  r->name = name;
+  r->p = s;
+  r->end = s + n;
+  r->start = s;
+  r->off = 0;
+  r->line = 1;
+  r->bol = 0;
+  r->err[0] = '\0';
+}
+
+// Offset of r->p in the whole input
+long lread_pos(lreader* r) {
+  return r->off + (r->p - r->start);
+}
+
+void lread_space(lreader* r) {
+  while (r->p < r->end && isspace((unsigned char)*r->p)) {
+    if (*r->p == '\n') {
+      r->line++;
+      r->bol = lread_pos(r) + 1;
+    }
+    r->p++;
+  }
+}
+
+int lread_symchar(int c) {
+  return isalnum(c) || (c && strchr("_+-*/\\=<>!&%^", c));
+}
+
+// Record a syntax error at the current position, always returns NULL
+lval* lread_error(lreader* r, char* expected) {
+  char at[16];
+  if (r->p == r->end) {
+    snprintf(at, sizeof(at), "end of input");
+  } else {
+    snprintf(at, sizeof(at), "'%c'", *r->p);
+  }
+  snprintf(r->err, sizeof(r->err), "%s:%d:%ld: error: expected %s at %s",
+    r->name, r->line, lread_pos(r) - r->bol + 1, expected, at);
+  return NULL;
+}
+
+// Number or Float from the n bytes of a number token
+lval* lread_num(char* s, int n) {
+  // 整数直接累加, 按负数累加才能表示LONG_MIN
+  if (!memchr(s, '.', n)) {
+    int neg = s[0] == '-';
+    long x = 0;
+    int ovf = 0;
+    for (int i = neg; i < n; i++) {
+      ovf |= __builtin_mul_overflow(x, 10, &x);
+      ovf |= __builtin_sub_overflow(x, s[i] - '0', &x);
+    }
+    if (!neg) { ovf |= __builtin_sub_overflow(0, x, &x); }
+    if (!ovf) { return lval_num(x); }
+  }
+  // 浮点数和大整数需要以'\0'结尾的字符串
+  char buf[64];
+  char* t = n < (int)sizeof(buf) ? buf : malloc(n + 1);
+  memcpy(t, s, n);
+  t[n] = '\0';
+  lval* x;
+  if (memchr(s, '.', n)) {
+    errno = 0;
+    double d = strtod(t, NULL);
+    x = errno != ERANGE ? lval_dbl(d) : lval_err("Invalid Number!");
+  } else {
+    x = lval_big(lbig_read(t));
+  }
+  if (t != buf) { free(t); }
+  return x;
+}
+
+// Read one expression, NULL on a syntax error
+lval* lread_expr(lreader* r) {
+  char* p = r->p;
+  if (p < r->end && *p == '(') {
+    r->p++;
+    return lread_list(r, lval_sexpr(), ')');
+  }
+  if (p < r->end && *p == '{') {
+    r->p++;
+    return lread_list(r, lval_qexpr(), '}');
+  }
+  if (p < r->end && *p == '"') {
+    return lread_str(r);
+  }
+  // 与文法一样先尝试数字: "1a"是数字1和符号a
+  char* q = p;
+  if (q < r->end && *q == '-') { q++; }
+  if (q < r->end && isdigit((unsigned char)*q)) {
+    while (q < r->end && isdigit((unsigned char)*q)) { q++; }
+    if (q < r->end && *q == '.') {
+      q++;
+      while (q < r->end && isdigit((unsigned char)*q)) { q++; }
+    }
+    r->p = q;
+    return lread_num(p, q - p);
+  }
+  q = p;
+  while (q < r->end && lread_symchar((unsigned char)*q)) { q++; }
+  if (q == p) {
+    return lread_error(r, "number, symbol, string, '(' or '{'");
+  }
+  r->p = q;
+  return lval_copy(lsym_intern_n(p, q - p));
+}
+
+// Read a string literal, r->p is at the opening quote
+lval* lread_str(lreader* r) {
+  r->p++;
+  // 转义后不会变长, 按原长度分配
+  char* q = r->p;
+  while (q < r->end && *q != '"') {
+    if (*q == '\\' && q + 1 < r->end) { q++; }
+    q++;
+  }
+  char* buf = malloc(q - r->p + 1);
+  int n = 0;
+  while (r->p < r->end && *r->p != '"') {
+    char c = *r->p++;
+    if (c == '\n') {
+      r->line++;
+      r->bol = lread_pos(r);
+    }
+    if (c == '\\' && r->p < r->end) {
+      c = *r->p++;
+      if (c == 'n') { c = '\n'; }
+      if (c == 't') { c = '\t'; }
+    }
+    buf[n++] = c;
+  }
+  if (r->p == r->end) {
+    free(buf);
+    return lread_error(r, "'\"'");
+  }
+  r->p++;
+  lval* x = lval_str(buf, n);
+  free(buf);
+  return x;
+}
+
+// Read expressions into x up to the close bracket, consumes x
+lval* lread_list(lreader* r, lval* x, char close) {
+  while (1) {
+    lread_space(r);
+    if (r->p == r->end || *r->p == ')' || *r->p == '}') { break; }
+    lval* y = lread_expr(r);
+    if (!y) {
+      lval_del(x);
+      return NULL;
+    }
+    lval_add(x, y);
+  }
+  if (r->p == r->end || *r->p != close) {
+    lval_del(x);
+    return lread_error(r, close == ')' ? "')'" : "'}'");
+  }
+  r->p++;
+  return x;
+}
+
+// Read every expression up to the end as one S-Expression
+lval* lread_all(lreader* r) {
+  lval* x = lval_sexpr();
+  while (1) {
+    lread_space(r);
+    if (r->p == r->end) { return x; }
+    lval* y = *r->p == ')' || *r->p == '}'
+      ? lread_error(r, "number, symbol, string, '(' or '{'")
+      : lread_expr(r);
+    if (!y) {
+      lval_del(x);
+      return NULL;
+    }
+    lval_add(x, y);
+  }
+}
+
+// ====================FILE=====================
+
+// Read all of fd into a malloc'd buffer, for inputs that cannot be mapped
+char* lfile_read(int fd, size_t* n) {
+  size_t cap = 1 << 16;
+  char* s = malloc(cap);
+  *n = 0;
+  while (1) {
+    if (*n == cap) {
+      cap *= 2;
+      s = realloc(s, cap);
+    }
+    long k = read(fd, s + *n, cap - *n);
+    if (k < 0 && errno == EINTR) { continue; }
+    if (k < 0) {
+      free(s);
+      return NULL;
+    }
+    if (k == 0) { return s; }
+    *n += k;
+  }
+}
+
+// Map the whole file into memory, NULL if it cannot be read.
+// 管道等不能映射的输入读到内存中, 此时*mapped为0
+char* lfile_map(char* path, size_t* n, int* mapped) {
+#ifdef _WIN32
+  *mapped = 0;
+  int fd = _open(path, _O_RDONLY | _O_BINARY);
+  if (fd < 0) { return NULL; }
+  char* s = lfile_read(fd, n);
+  _close(fd);
+  return s;
+#else
+  *mapped = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return NULL; }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    close(fd);
+    errno = EISDIR;
+    return NULL;
+  }
+  // FIFO, /dev/stdin等的st_size为0, 只能读到结束
+  if (!S_ISREG(st.st_mode)) {
+    char* s = lfile_read(fd, n);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return s;
+  }
+  *n = st.st_size;
+  // 空文件不能映射, 返回一个空的范围
+  static char empty[1];
+  char* s = empty;
+  if (*n > 0) {
+    s = mmap(NULL, *n, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s == MAP_FAILED) { s = NULL; }
+  }
+  int err = errno;
+  close(fd);
+  errno = err;
+  *mapped = 1;
+  return s;
+#endif
+}
+
+void lfile_unmap(char* s, size_t n, int mapped) {
+#ifndef _WIN32
+  if (mapped) {
+    if (n > 0) { munmap(s, n); }
+    return;
+  }
+#endif
+  free(s);
+}
+
+// Evaluate every top-level expression in the file, errors are printed.
+// Returns an Error if the file cannot be read or does not parse
+lval* lval_load(lenv* e, char* path) {
+  size_t n;
+  int mapped;
+  char* s = lfile_map(path, &n, &mapped);
+  if (!s) {
+    return lval_err("Could not load file '%s': %s", path, strerror(errno));
+  }
+  lreader r;
+  lreader_init(&r, path, s, n);
+  lval* result = lval_sexpr();
+  while (1) {
+    lread_space(&r);
+    if (r.p == r.end) { break; }
+    // 每读完一个表达式就求值, 之后的语法错误不影响前面的表达式
+    lval* x = *r.p == ')' || *r.p == '}'
+      ? lread_error(&r, "number, symbol, string, '(' or '{'")
+      : lread_expr(&r);
+    if (!x) {
+      lval_del(result);
+      result = lval_err("%s", r.err);
+      break;
+    }
+    x = lval_eval(e, x);
+    if (x->lisptype == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+  lfile_unmap(s, n, mapped);
+  return result;
+}
+
+// Evaluate the forms read from fd one at a time as they complete and print every
+// result like the REPL. Only the unfinished form is kept in memory, so the
+// input can be arbitrarily long. Returns 1 if there was a syntax error
+int lval_batch(lenv* e, int fd) {
+  size_t cap = 1 << 16;
+  char* buf = malloc(cap);
+  size_t len = 0;
+  // buf[0]在输入流中的偏移
+  long off = 0;
+  // 扫描状态: 括号深度, 字符串内, 转义, 顶层有未结束的原子
+  int depth = 0, instr = 0, esc = 0, atom = 0;
+  // [seg, i)是还没求值的部分
+  size_t seg = 0, i = 0;
+  int status = 0;
+  lreader r;
+  lreader_init(&r, "<stdin>", buf, 0);
+  // 输出由stdio缓冲, 读完已经到达的输入后才写出
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  while (1) {
+    if (len == cap) {
+      // 单个表达式比缓冲区还大
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    // read只返回已经到达的数据, 管道另一端写完一个表达式就能求值
+    long n = read(fd, buf + len, cap - len);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { n = 0; }
+    len += n;
+
+    while (i < len || (n == 0 && seg < len)) {
+      // 找到一个完整的顶层表达式的结尾cut, 输入结束时剩下的全部交给读取器
+      size_t cut = 0;
+      if (i == len) {
+        cut = len;
+      } else {
+        char c = buf[i++];
+        if (instr) {
+          if (esc) { esc = 0; }
+          else if (c == '\\') { esc = 1; }
+          else if (c == '"') {
+            instr = 0;
+            if (!depth) { cut = i; }
+          }
+          continue;
+        }
+        if (c == '"') {
+          instr = 1;
+        } else if (c == '(' || c == '{') {
+          depth++;
+        } else if (c == ')' || c == '}') {
+          // 多余的右括号也在这里断开, 由读取器报错
+          if (depth) { depth--; }
+          if (!depth) { cut = i; }
+        } else if (isspace((unsigned char)c)) {
+          if (!depth && atom) { cut = i; }
+        }
+        atom = !depth && !instr && !isspace((unsigned char)c)
+          && !strchr("(){}\"", c);
+        if (!cut) { continue; }
+      }
+
+      r.start = buf;
+      r.off = off;
+      r.p = buf + seg;
+      r.end = buf + cut;
+      seg = cut;
+      while (1) {
+        lread_space(&r);
+        if (r.p == r.end) { break; }
+        lval* x = *r.p == ')' || *r.p == '}'
+          ? lread_error(&r, "number, symbol, string, '(' or '{'")
+          : lread_expr(&r);
+        if (!x) {
+          puts(r.err);
+          status = 1;
+          // 跳过出错的表达式, 继续统计行号
+          for (; r.p < r.end; r.p++) {
+            if (*r.p == '\n') {
+              r.line++;
+              r.bol = lread_pos(&r) + 1;
+            }
+          }
+          break;
+        }
+        x = lval_eval(e, x);
+        lval_println(x);
+        lval_del(x);
+      }
+    }
+    if (n == 0) { break; }
+    // 已到达的完整表达式都求值了, 写出它们的结果
+    fflush(stdout);
+
+    // 丢掉已经求值的部分
+    memmove(buf, buf + seg, len - seg);
+    len -= seg;
+    i -= seg;
+    off += seg;
+    seg = 0;
+  }
+  free(buf);
+  fflush(stdout);
+  return status;
+}
+
+// (load "file.lsp")
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+  lval* x = lval_load(e, a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
+
+// Print the arguments separated by spaces, strings without quotes
+lval* builtin_print(lenv* e, lval* a) {
+  lout o = {0};
+  lval_write_args(&o, a);
+  lout_putc(&o, '\n');
+  lout_flush(&o, stdout);
+  free(o.s);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+// The text print would output, as a String
+lval* builtin_to_string(lenv* e, lval* a) {
+  lout o = {0};
+  lval_write_args(&o, a);
+  lval* x = lval_str(o.s, o.len);
+  free(o.s);
+  lval_del(a);
+  return x;
+}
+
+
+// ====================DUMP=====================
+
+// 二进制格式: 文件头LDUMP_MAGIC之后是一个lval. 每个lval以一个标记字节开始,
+// 长度和整数用varint(每字节7位, 最高位表示后面还有), 负数先做zigzag变换.
+// 符号第一次出现时写出名字, 之后只写编号. 浮点数, 大整数和向量按本机字节序
+// 原样存放, 解码向量只需一次memcpy
+#define LDUMP_MAGIC "MiLispD1"
+
+enum { LDUMP_NUM, LDUMP_DBL, LDUMP_BIG, LDUMP_STR, LDUMP_ERR, LDUMP_SYM,
+       LDUMP_SYMREF, LDUMP_SEXPR, LDUMP_QEXPR, LDUMP_VEC, LDUMP_BUILTIN,
+       LDUMP_LAMBDA };
+
+// 编码和解码都是递归的, 限制嵌套深度以免栈溢出
+#define LDUMP_DEPTH 10000
+
+void ldump_varint(ldump* d, unsigned long x) {
+  while (x >= 0x80) {
+    lout_putc(&d->out, (char)(x | 0x80));
+    x >>= 7;
+  }
+  lout_putc(&d->out, (char)x);
+}
+
+// Write a symbol, only its number if it was written before
+void ldump_sym(ldump* d, char* s) {
+  if (d->nsyms * 2 >= d->cap) {
+    int cap = d->cap ? d->cap * 2 : 256;
+    char** keys = calloc(cap, sizeof(char*));
+    int* ids = malloc(sizeof(int) * cap);
+    for (int i = 0; i < d->cap; i++) {
+      if (!d->keys[i]) { continue; }
+      unsigned long j = ((uintptr_t)d->keys[i] >> 3) & (cap - 1);
+      while (keys[j]) { j = (j + 1) & (cap - 1); }
+      keys[j] = d->keys[i];
+      ids[j] = d->ids[i];
+    }
+    free(d->keys);
+    free(d->ids);
+    d->keys = keys;
+    d->ids = ids;
+    d->cap = cap;
+  }
+  unsigned long i = ((uintptr_t)s >> 3) & (d->cap - 1);
+  while (d->keys[i]) {
+    if (d->keys[i] == s) {
+      lout_putc(&d->out, LDUMP_SYMREF);
+      ldump_varint(d, d->ids[i]);
+      return;
+    }
+    i = (i + 1) & (d->cap - 1);
+  }
+  d->keys[i] = s;
+  d->ids[i] = d->nsyms++;
+  size_t n = strlen(s);
+  lout_putc(&d->out, LDUMP_SYM);
+  ldump_varint(d, n);
+  lout_puts(&d->out, s, n);
+}
+
+// Encode v, returns an error message or NULL
+char* ldump_write(ldump* d, lval* v) {
+  if (d->depth == LDUMP_DEPTH) { return "Cannot dump value nested too deeply"; }
+  d->depth++;
+  char* err = ldump_node(d, v);
+  d->depth--;
+  return err;
+}
+
+char* ldump_node(ldump* d, lval* v) {
+  lout* o = &d->out;
+  switch (v->lisptype) {
+    case LVAL_NUM:
+      lout_putc(o, LDUMP_NUM);
+      ldump_varint(d, ((unsigned long)v->lnum << 1)
+        ^ (unsigned long)(v->lnum >> (sizeof(long) * CHAR_BIT - 1)));
+      break;
+    case LVAL_DBL:
+      lout_putc(o, LDUMP_DBL);
+      lout_puts(o, (char*)&v->dnum, sizeof(double));
+      break;
+    case LVAL_BIG:
+      lout_putc(o, LDUMP_BIG);
+      lout_putc(o, v->big->sign < 0);
+      ldump_varint(d, v->big->count);
+      lout_puts(o, (char*)v->big->d, sizeof(uint32_t) * v->big->count);
+      break;
+    case LVAL_STR:
+    case LVAL_ERR: {
+      char* s = v->lisptype == LVAL_STR ? v->str : v->err;
+      size_t n = strlen(s);
+      lout_putc(o, v->lisptype == LVAL_STR ? LDUMP_STR : LDUMP_ERR);
+      ldump_varint(d, n);
+      lout_puts(o, s, n);
+      break;
+    }
+    case LVAL_SYM:
+      ldump_sym(d, v->sym);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lout_putc(o, v->lisptype == LVAL_SEXPR ? LDUMP_SEXPR : LDUMP_QEXPR);
+      ldump_varint(d, v->count);
+      for (int i = 0; i < v->count; i++) {
+        char* err = ldump_write(d, v->cell[i]);
+        if (err) { return err; }
+      }
+      break;
+    case LVAL_VEC:
+      lout_putc(o, LDUMP_VEC);
+      lout_putc(o, v->vec->dbl);
+      ldump_varint(d, v->vec->count);
+      lout_puts(o, (char*)v->vec->items, sizeof(v->vec->items[0]) * v->vec->count);
+      break;
+    case LVAL_FUN: {
+      if (v->builtin) {
+        char* name = lbuiltin_name(v->builtin);
+        if (!name) { return "Cannot dump unregistered builtin"; }
+        size_t n = strlen(name);
+        lout_putc(o, LDUMP_BUILTIN);
+        ldump_varint(d, n);
+        lout_puts(o, name, n);
+        break;
+      }
+      // Lambda: 参数, 函数体, 以及部分应用时已经绑定的参数
+      lout_putc(o, LDUMP_LAMBDA);
+      char* err = ldump_write(d, v->formals);
+      if (!err) { err = ldump_write(d, v->code->body); }
+      if (err) { return err; }
+      ldump_varint(d, v->env->count);
+      for (int i = 0; i < v->env->count; i++) {
+        ldump_sym(d, v->env->syms[i]);
+        err = ldump_write(d, v->env->vals[i]);
+        if (err) { return err; }
+      }
+      break;
+    }
+    default:
+      return "Cannot dump unknown type";
+  }
+  return NULL;
+}
+
+int lundump_varint(lundump* u, unsigned long* x) {
+  *x = 0;
+  for (int shift = 0; u->p < u->end && shift < 64; shift += 7) {
+    unsigned char c = *u->p++;
+    *x |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) { return 1; }
+  }
+  return 0;
+}
+
+// Decode one lval, NULL if the input is truncated, malformed or too deep
+lval* lundump_read(lundump* u) {
+  if (u->p == u->end || u->depth == LDUMP_DEPTH) { return NULL; }
+  u->depth++;
+  lval* x = lundump_node(u, (unsigned char)*u->p++);
+  u->depth--;
+  return x;
+}
+
+// Decode the lval that follows tag
+lval* lundump_node(lundump* u, int tag) {
+  unsigned long n;
+  switch (tag) {
+    case LDUMP_NUM:
+      if (!lundump_varint(u, &n)) { return NULL; }
+      return lval_num((long)(n >> 1) ^ -(long)(n & 1));
+    case LDUMP_DBL: {
+      if (u->end - u->p < (long)sizeof(double)) { return NULL; }
+      double x;
+      memcpy(&x, u->p, sizeof(double));
+      u->p += sizeof(double);
+      return lval_dbl(x);
+    }
+    case LDUMP_BIG: {
+      // 符号字节只能是0或1
+      if (u->p == u->end || (unsigned char)*u->p > 1) { return NULL; }
+      int neg = *u->p++;
+      if (!lundump_varint(u, &n)) { return NULL; }
+      if (n == 0 || n > (unsigned long)(u->end - u->p) / sizeof(uint32_t)) {
+        return NULL;
+      }
+      lbig* b = lbig_new(n);
+      memcpy(b->d, u->p, sizeof(uint32_t) * n);
+      u->p += sizeof(uint32_t) * n;
+      b->sign = neg ? -1 : 1;
+      return lval_big(lbig_trim(b));
+    }
+    case LDUMP_STR:
+    case LDUMP_ERR:
+    case LDUMP_SYM:
+    case LDUMP_BUILTIN: {
+      if (!lundump_varint(u, &n)) { return NULL; }
+      if (n > (unsigned long)(u->end - u->p) || n > INT_MAX) { return NULL; }
+      char* s = u->p;
+      u->p += n;
+      if (tag == LDUMP_STR) { return lval_str(s, n); }
+      if (tag == LDUMP_ERR) { return lval_err("%.*s", (int)n, s); }
+      if (tag == LDUMP_BUILTIN) {
+        lbuiltin f = lbuiltin_find(s, n);
+        return f ? lval_fun(f) : NULL;
+      }
+      // 新的符号加入编号表
+      if (u->nsyms == u->cap) {
+        u->cap = u->cap ? u->cap * 2 : 256;
+        u->syms = realloc(u->syms, sizeof(lval*) * u->cap);
+      }
+      lval* x = lsym_intern_n(s, n);
+      u->syms[u->nsyms++] = x;
+      return lval_copy(x);
+    }
+    case LDUMP_SYMREF:
+      if (!lundump_varint(u, &n) || n >= (unsigned long)u->nsyms) { return NULL; }
+      return lval_copy(u->syms[n]);
+    case LDUMP_SEXPR:
+    case LDUMP_QEXPR: {
+      // 每个元素至少一个字节, 长度不可能超过剩下的字节数
+      if (!lundump_varint(u, &n)) { return NULL; }
+      if (n > (unsigned long)(u->end - u->p)) { return NULL; }
+      lval* x = tag == LDUMP_SEXPR ? lval_sexpr() : lval_qexpr();
+      if (n > 0) { lval_cells_reserve(x, n); }
+      for (unsigned long i = 0; i < n; i++) {
+        lval* y = lundump_read(u);
+        if (!y) {
+          lval_del(x);
+          return NULL;
+        }
+        lval_add(x, y);
+      }
+      return x;
+    }
+    case LDUMP_VEC: {
+      if (u->p == u->end || (unsigned char)*u->p > 1) { return NULL; }
+      int dbl = *u->p++;
+      if (!lundump_varint(u, &n)) { return NULL; }
+      lvec* v = NULL;
+      if (n > (unsigned long)(u->end - u->p) / sizeof(v->items[0])) { return NULL; }
+      v = lvec_new(n, dbl);
+      memcpy(v->items, u->p, sizeof(v->items[0]) * n);
+      u->p += sizeof(v->items[0]) * n;
+      return lval_vec(v);
+    }
+    case LDUMP_LAMBDA: {
+      lval* formals = lundump_read(u);
+      lval* body = formals ? lundump_read(u) : NULL;
+      // 与builtin_lambda一样, 参数表只能包含符号
+      int ok = body && formals->lisptype == LVAL_QEXPR
+        && body->lisptype == LVAL_QEXPR;
+      for (int i = 0; ok && i < formals->count; i++) {
+        ok = formals->cell[i]->lisptype == LVAL_SYM;
+      }
+      if (!ok || !lundump_varint(u, &n)) {
+        if (formals) { lval_del(formals); }
+        if (body) { lval_del(body); }
+        return NULL;
+      }
+      lenv* env = lenv_new();
+      for (unsigned long i = 0; i < n; i++) {
+        lval* k = lundump_read(u);
+        lval* x = k ? lundump_read(u) : NULL;
+        if (!x || k->lisptype != LVAL_SYM) {
+          if (k) { lval_del(k); }
+          if (x) { lval_del(x); }
+          lval_del(formals);
+          lval_del(body);
+          lenv_del(env);
+          return NULL;
+        }
+        lenv_put(env, k, x);
+        lval_del(k);
+        lval_del(x);
+      }
+      // 部分应用的函数体是按完整的参数表编译的, 已绑定的参数在前
+      lval* all = lval_qexpr();
+      for (int i = 0; i < env->count; i++) {
+        lval_add(all, lval_sym(env->syms[i]));
+      }
+      for (int i = 0; i < formals->count; i++) {
+        lval_add(all, lval_copy(formals->cell[i]));
+      }
+      lval* f = lval_lambda(all, body);
+      lval_del(f->formals);
+      f->formals = formals;
+      lenv_del(f->env);
+      f->env = env;
+      return f;
+    }
+    default:
+      return NULL;
+  }
+}
+
+// Write the encoded bytes to path and free d, returns () or an Error
+lval* ldump_save(ldump* d, char* path) {
+  lval* x = NULL;
+  FILE* f = fopen(path, "wb");
+  if (!f || fwrite(d->out.s, 1, d->out.len, f) != d->out.len) {
+    x = lval_err("Could not write '%s': %s", path, strerror(errno));
+  }
+  if (f && fclose(f) != 0 && !x) {
+    x = lval_err("Could not write '%s': %s", path, strerror(errno));
+  }
+  free(d->out.s);
+  free(d->keys);
+  free(d->ids);
+  return x ? x : lval_sexpr();
+}
+
+// Map path and check that it starts with magic, returns an Error or NULL
+lval* lundump_open(lundump* u, char* path, char* magic) {
+  memset(u, 0, sizeof(*u));
+  u->map = lfile_map(path, &u->size, &u->mapped);
+  if (!u->map) {
+    return lval_err("Could not read '%s': %s", path, strerror(errno));
+  }
+  size_t m = strlen(magic);
+  if (u->size < m || memcmp(u->map, magic, m) != 0) {
+    lfile_unmap(u->map, u->size, u->mapped);
+    return lval_err("Invalid file '%s'", path);
+  }
+  u->p = u->map + m;
+  u->end = u->map + u->size;
+  return NULL;
+}
+
+void lundump_close(lundump* u) {
+  free(u->syms);
+  lfile_unmap(u->map, u->size, u->mapped);
+}
+
+// Write v to the file at path in the binary format
+lval* lval_dump(lval* v, char* path) {
+  ldump d = {{0}};
+  lout_puts(&d.out, LDUMP_MAGIC, strlen(LDUMP_MAGIC));
+  char* err = ldump_write(&d, v);
+  if (err) {
+    free(d.out.s);
+    free(d.keys);
+    free(d.ids);
+    return lval_err("%s", err);
+  }
+  return ldump_save(&d, path);
+}
+
+// Read back a value written by lval_dump
+lval* lval_undump(char* path) {
+  lundump u;
+  lval* err = lundump_open(&u, path, LDUMP_MAGIC);
+  if (err) { return err; }
+  lval* x = lundump_read(&u);
+  if (x && u.p != u.end) {
+    lval_del(x);
+    x = NULL;
+  }
+  lundump_close(&u);
+  return x ? x : lval_err("Invalid file '%s'", path);
+}
+
+// 映像文件: 文件头LIMAGE_MAGIC, 绑定的个数, 然后是每个绑定的符号和值.
+// 与dump使用同一个符号表, 启动时直接映射文件解码, 不需要重新求值源代码
+#define LIMAGE_MAGIC "MiLispI1"
+
+// 启动时lenv_add_builtins会重新注册的内置函数不必保存
+int limage_skip(lenv* e, int i) {
+  lbuiltin f = e->vals[i]->lisptype == LVAL_FUN ? e->vals[i]->builtin : NULL;
+  return f && lbuiltin_find(e->syms[i], strlen(e->syms[i])) == f;
+}
+
+// Save every global binding to path
+lval* lval_image_save(lenv* e, char* path) {
+  while (e->par) { e = e->par; }
+  ldump d = {{0}};
+  lout_puts(&d.out, LIMAGE_MAGIC, strlen(LIMAGE_MAGIC));
+  int n = 0;
+  for (int i = 0; i < e->count; i++) {
+    if (!limage_skip(e, i)) { n++; }
+  }
+  ldump_varint(&d, n);
+  for (int i = 0; i < e->count; i++) {
+    if (limage_skip(e, i)) { continue; }
+    ldump_sym(&d, e->syms[i]);
+    char* err = ldump_write(&d, e->vals[i]);
+    if (err) {
+      free(d.out.s);
+      free(d.keys);
+      free(d.ids);
+      return lval_err("Could not save '%s': %s", e->syms[i], err);
+    }
+  }
+  return ldump_save(&d, path);
+}
+
+// Define every binding saved by lval_image_save in the global environment
+lval* lval_image_load(lenv* e, char* path) {
+  while (e->par) { e = e->par; }
+  lundump u;
+  lval* err = lundump_open(&u, path, LIMAGE_MAGIC);
+  if (err) { return err; }
+  unsigned long n;
+  int ok = lundump_varint(&u, &n);
+  if (ok) { lenv_reserve(e, e->count + (n < 1 << 20 ? n : 0)); }
+  for (unsigned long i = 0; ok && i < n; i++) {
+    lval* k = lundump_read(&u);
+    lval* v = k ? lundump_read(&u) : NULL;
+    ok = v && k->lisptype == LVAL_SYM;
+    if (ok) { lenv_put(e, k, v); }
+    if (k) { lval_del(k); }
+    if (v) { lval_del(v); }
+  }
+  ok = ok && u.p == u.end;
+  lundump_close(&u);
+  return ok ? lval_sexpr() : lval_err("Invalid file '%s'", path);
+}
+
+
+// (dump "file" value)
+lval* builtin_dump(lenv* e, lval* a) {
+  LASSERT_NUM("dump", a, 2);
+  LASSERT_TYPE("dump", a, 0, LVAL_STR);
+  lval* x = lval_dump(a->cell[1], a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
+
+// (undump "file")
+lval* builtin_undump(lenv* e, lval* a) {
+  LASSERT_NUM("undump", a, 1);
+  LASSERT_TYPE("undump", a, 0, LVAL_STR);
+  lval* x = lval_undump(a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
+
+// (save-image "file"), start from it with MiLisp --image file
+lval* builtin_save_image(lenv* e, lval* a) {
+  LASSERT_NUM("save-image", a, 1);
+  LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+  lval* x = lval_image_save(e, a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
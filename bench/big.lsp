@@ -0,0 +1,5 @@
+(def {fact} (\ {n acc} {if (== n 0) {acc} {fact (- n 1) (* acc n)}}))
+(def {sq} (\ {x n} {if (== n 0) {x} {sq (* x x) (- n 1)}}))
+(def {f} (fact 5000 1))
+(print (== (/ (* f f) f) f))
+(print (> (sq f 5) 0))
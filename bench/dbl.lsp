@@ -0,0 +1,4 @@
+(def {loop} (\ {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc 0.1)}}))
+(print (loop 1000000 0.0))
+(print (+ 0.1 0.2) 0.1 (/ 1.0 3) (- 0.0 (/ 2.0 3)) 100.0 2.5)
+(print (list 0.3 (+ 0.1 0.2) (vec {0.1 0.7})))
@@ -0,0 +1,12 @@
+(load "bench/fixtures.lsp")
+(def {data} (list (build (\ {n} {list n 2.5 "str" {sym (n)}}) 200000 {}) (vec (nums 1000000 {}))))
+(dump "/tmp/milisp-bench.dump" data)
+(print (== (undump "/tmp/milisp-bench.dump") data))
+(dump "/tmp/milisp-bench.dump" data)
+(print (== (undump "/tmp/milisp-bench.dump") data))
+(dump "/tmp/milisp-bench.dump" data)
+(print (== (undump "/tmp/milisp-bench.dump") data))
+(def {wrap} (\ {x n} {if (== n 0) {x} {wrap (list x) (- n 1)}}))
+(dump "/tmp/milisp-bench.dump" (wrap 1 9000))
+(print (== (undump "/tmp/milisp-bench.dump") (wrap 1 9000)))
+(print (dump "/tmp/milisp-bench.dump" (wrap 1 20000)))
@@ -0,0 +1,2 @@
+(def {fib} (\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(fib 24)
@@ -0,0 +1,4 @@
+(def {dbl} (\ {l n} {if (== n 0) {l} {dbl (join l l) (- n 1)}}))
+(def {nums} (\ {n acc} {if (== n 0) {acc} {nums (- n 1) (join acc (list n))}}))
+(def {build} (\ {f n acc} {if (== n 0) {acc} {build f (- n 1) (join acc (f n))}}))
+(def {sum} (\ {l acc} {if (== l {}) {acc} {sum (tail l) (+ acc (eval (head l)))}}))
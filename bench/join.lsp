@@ -0,0 +1,2 @@
+(load "bench/fixtures.lsp")
+(sum (nums 100000 {}) 0)
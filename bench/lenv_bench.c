@@ -0,0 +1,45 @@
+// 环境查找的微基准
+// gcc -std=c99 -O2 bench/lenv_bench.c -ledit -lm -o lenv_bench
+#define main milisp_main
+#include "../MiLisp.c"
+#undef main
+
+#include <time.h>
+
+#define LOOKUPS 10000000
+
+void bench_lookup(int n) {
+  char name[32];
+  lenv* e = lenv_new();
+  lval** keys = malloc(sizeof(lval*) * n);
+  for (int i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "sym%d", i);
+    keys[i] = lval_sym(name);
+    lval* v = lval_num(i);
+    lenv_put(e, keys[i], v);
+    lval_del(v);
+  }
+
+  long sum = 0;
+  clock_t start = clock();
+  for (int i = 0; i < LOOKUPS; i++) {
+    lval* v = lenv_get(e, keys[(int)((i * 7919L) % n)]);
+    sum += v->lnum;
+    lval_del(v);
+  }
+  double t = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("%7d bindings: %6.1f ns/lookup (%ld)\n", n, t * 1e9 / LOOKUPS, sum);
+
+  for (int i = 0; i < n; i++) { lval_del(keys[i]); }
+  free(keys);
+  lenv_del(e);
+}
+
+int main(void) {
+  lval_small_init();
+  lsym_init();
+  bench_lookup(10);
+  bench_lookup(1000);
+  bench_lookup(100000);
+  return 0;
+}
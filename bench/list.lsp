@@ -0,0 +1,3 @@
+(load "bench/fixtures.lsp")
+(def {big} (dbl {1} 20))
+(sum big 0)
@@ -0,0 +1,12 @@
+(load "prelude.lsp")
+(load "bench/fixtures.lsp")
+(def {l} (nums 1000000 {}))
+(def {sq} (\ {x} {* x x}))
+(def {odd} (\ {x} {- x (* 2 (/ x 2))}))
+(print (len (map sq l)) (len (filter odd l)) (foldl + 0 l) (nth 999999 (reverse l)))
+(def {s} (nums 2000 {}))
+(print (== (map sq s) (lisp-map sq s)) (== (filter odd s) (lisp-filter odd s)))
+(print (== (foldl + 0 s) (lisp-foldl + 0 s)) (== (reverse s) (lisp-reverse s)))
+(print (== (nth 1234 s) (lisp-nth 1234 s)) (== (len s) (lisp-len s)))
+(print (== (map sq {}) (lisp-map sq {})) (== (filter odd {}) (lisp-filter odd {})))
+(print (== (reverse {}) (lisp-reverse {})) (== (len {}) (lisp-len {})))
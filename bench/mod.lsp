@@ -0,0 +1,6 @@
+(print (% 7 3) (% -7 3) (% 7 -3) (% 7.5 2))
+(print (% (^ 10 30) 7) (% (vec {7 8 9}) 4))
+(print (% 7 0))
+(print (% 7.5 0))
+(print (% (^ 10 30) 0))
+(print (% (vec {1 2}) 0))
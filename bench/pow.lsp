@@ -0,0 +1,8 @@
+(def {loop} (\ {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc (^ 3 20) (^ -1 n))}}))
+(print (loop 200000 0))
+(print (^ 2 10) (^ 2 64) (^ 2 3 2) (^ 2.0 0.5))
+(print (^ 2 -1) (^ -2 -3) (^ 1 -5) (^ 0 -1))
+(print (^ (^ 2 64) -1))
+(print (^ (vec {1 2 3}) 2) (^ (vec {1.0 2.0}) -1))
+(print (^ (vec {1 2 3}) -1))
+(print (^ 3 (^ 2 64)))
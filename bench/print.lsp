@@ -0,0 +1,8 @@
+(load "bench/fixtures.lsp")
+(def {l} (build (\ {n} {list n 2.5 "s"}) 300000 {}))
+(print l)
+(print l)
+(print l)
+(print l)
+(print l)
+(print l)
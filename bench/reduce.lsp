@@ -0,0 +1,7 @@
+(load "bench/fixtures.lsp")
+(def {big} (join {+} (dbl {1 2000 3 -7} 21)))
+(eval big)
+(eval big)
+(eval big)
+(eval big)
+(eval big)
@@ -0,0 +1,35 @@
+#!/bin/bash
+# 对比两种求值引擎: bash bench/run.sh [./MiLisp]
+# 有name.out的测试还要检查输出, 不一致时退出状态为1
+BIN=${1:-./MiLisp}
+# 测试在仓库根目录下运行, 其中的load路径都相对于根目录
+case "$BIN" in
+  */*) BIN=$(cd "$(dirname "$BIN")" && pwd)/$(basename "$BIN") ;;
+esac
+cd "$(dirname "$0")/.." || exit 1
+DIR=bench
+# 树遍历求值器没有尾调用优化, 深度递归的测试只用虚拟机运行
+TREE="fib sum slice"
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+status=0
+check() {
+  if [ -f "$DIR/$1.out" ] && ! diff -u "$DIR/$1.out" "$OUT"; then
+    echo "FAIL: $1 ($2)"
+    status=1
+  fi
+}
+for f in "$DIR"/*.lsp; do
+  name=$(basename "$f" .lsp)
+  # fixtures.lsp只定义其他测试共用的函数
+  [ "$name" = fixtures ] && continue
+  echo "== $f (vm)"
+  time "$BIN" "$f" > "$OUT"
+  check "$name" vm
+  if [[ " $TREE " == *" $name "* ]]; then
+    echo "== $f (tree)"
+    time "$BIN" --tree "$f" > "$OUT"
+    check "$name" tree
+  fi
+done
+exit $status
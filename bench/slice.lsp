@@ -0,0 +1,7 @@
+(def {mk} (\ {x} {list x}))
+(def {a} (mk 1))
+(print (join (tail a) {2}))
+(print (join (tail a) (tail a) {3 4}))
+(def {b} (mk 5))
+(def {c} (join (tail b) {6} {7}))
+(print b c (join c (tail c)))
@@ -0,0 +1,5 @@
+(def {sum} (\ {n acc} {if (== n 0) {acc} {sum (- n 1) (+ acc n)}}))
+(sum 5000 0)
+(sum 5000 0)
+(sum 5000 0)
+(sum 5000 0)
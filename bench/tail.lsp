@@ -0,0 +1,8 @@
+(def {count} (\ {n acc} {if (== n 0) {acc} {count (- n 1) (+ acc 1)}}))
+(print (count 10000000 0))
+(def {do-loop} (\ {k} {loop2 k}))
+(def {loop2} (\ {m} {if (== m 0) {0} {do-loop (- m 1)}}))
+(print (loop2 1000000))
+(def {g} (\ {x y} {if (== x 0) {y} {h (- x 1)}}))
+(def {h} (\ {z} {g z (+ y 1)}))
+(print (g 1000000 0))
@@ -0,0 +1,5 @@
+(load "bench/fixtures.lsp")
+(def {v} (vec (dbl {1 2 3 4} 18)))
+(def {loop} (\ {n acc} {if (== n 0) {acc} {loop (- n 1) (- (+ acc v v) v 1)}}))
+(vget (loop 100 v) 7)
+(vlen v)
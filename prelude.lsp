@@ -0,0 +1,10 @@
+(def {lisp-len-acc} (\ {l n} {if (== l {}) {n} {lisp-len-acc (tail l) (+ n 1)}}))
+(def {lisp-len} (\ {l} {lisp-len-acc l 0}))
+(def {lisp-nth} (\ {n l} {if (== n 0) {eval (head l)} {lisp-nth (- n 1) (tail l)}}))
+(def {lisp-foldl} (\ {f z l} {if (== l {}) {z} {lisp-foldl f (f z (eval (head l))) (tail l)}}))
+(def {lisp-reverse-acc} (\ {l acc} {if (== l {}) {acc} {lisp-reverse-acc (tail l) (join (head l) acc)}}))
+(def {lisp-reverse} (\ {l} {lisp-reverse-acc l {}}))
+(def {lisp-map-acc} (\ {f l acc} {if (== l {}) {acc} {lisp-map-acc f (tail l) (join acc (list (f (eval (head l)))))}}))
+(def {lisp-map} (\ {f l} {lisp-map-acc f l {}}))
+(def {lisp-filter-acc} (\ {f l acc} {if (== l {}) {acc} {lisp-filter-acc f (tail l) (if (f (eval (head l))) {join acc (head l)} {acc})}}))
+(def {lisp-filter} (\ {f l} {lisp-filter-acc f l {}}))